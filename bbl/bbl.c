@@ -5,6 +5,7 @@
 #include "bits.h"
 #include "config.h"
 #include "fdt.h"
+#include "htif.h"
 #include <string.h>
 
 static const void* entry_point;
@@ -28,6 +29,12 @@ static void filter_dtb(uintptr_t source)
   filter_plic(dest);
   filter_compat(dest, "riscv,clint0");
   filter_compat(dest, "riscv,debug-013");
+#ifdef PK_ENABLE_DISK_CACHE
+  filter_mem(dest, mem_size); // hide the disk cache
+#endif
+
+  // Add information to the chained FDT
+  htif_disk_publish(dest);
 }
 
 void boot_other_hart(uintptr_t unused __attribute__((unused)))
@@ -0,0 +1 @@
+// Stand-in for the configure-generated config.h when building hostfe
@@ -0,0 +1,362 @@
+// See LICENSE for license details.
+
+// hostfe: run pk's syscall proxy path on a plain Linux host.
+//
+// pk/frontend.c and machine/htif.c are compiled natively and talk to a host
+// thread that plays fesvr: it watches tohost, services syscall-device
+// requests against a local directory and answers through fromhost, one
+// request at a time and in order, as fesvr does. "Physical" addresses are
+// host pointers. The main thread then times proxied syscalls.
+//
+// Build from the top of the source tree:
+//
+//   gcc -O2 -pthread -D__riscv -D__riscv_xlen=64 -D__riscv_atomic
+//       -Ihostfe -Ipk -Imachine hostfe/*.c -o hostfe.out
+//
+// Run:
+//
+//   ./hostfe.out [-d dir] [-l latency_ns] [-n iterations]
+//
+// -l adds a fixed delay to every request to model a slow tether.
+// -d selects the directory the proxied syscalls operate in (default ".").
+//
+// Both sides busy-wait, as they do on real hardware, so the numbers are only
+// meaningful with at least two host CPUs; on one CPU every hand-off costs a
+// scheduler time slice.
+
+#include "frontend.h"
+#include "syscall.h"
+#include "htif.h"
+#include "fdt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+extern volatile uint64_t tohost;
+extern volatile uint64_t fromhost;
+
+static int root_fd;
+static long latency_ns;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Stand-ins for the pk and machine symbols the proxied code refers to
+
+uintptr_t va2pa(const void* va)
+{
+  return (uintptr_t)va;
+}
+
+void file_sync_all()
+{
+}
+
+void syscall_prof_dump()
+{
+}
+
+void printm(const char* s, ...)
+{
+  va_list vl;
+  va_start(vl, s);
+  vfprintf(stderr, s, vl);
+  va_end(vl);
+}
+
+void poweroff(uint16_t code)
+{
+  exit(code);
+}
+
+void kassert_fail(const char* s)
+{
+  fprintf(stderr, "assertion failed: %s\n", s);
+  abort();
+}
+
+void do_panic(const char* s, ...)
+{
+  va_list vl;
+  va_start(vl, s);
+  vfprintf(stderr, s, vl);
+  va_end(vl);
+  abort();
+}
+
+void fdt_scan_compatible(uintptr_t fdt, const char* compat, const struct fdt_cb* cb)
+{
+}
+
+void fdt_add_node(uintptr_t fdt, const char* name, const struct fdt_new_prop* props, int nprops)
+{
+}
+
+// The host side
+
+static int host_dirfd(uint64_t fd)
+{
+  return (int)fd == AT_FDCWD ? root_fd : (int)fd;
+}
+
+static const char* host_path(uint64_t pa)
+{
+  const char* path = (const char*)pa;
+  while (*path == '/')
+    path++;
+  return *path ? path : ".";
+}
+
+static struct iovec* host_iov(uint64_t pa, uint64_t cnt)
+{
+  static struct iovec iov[FRONTEND_IOV_MAX];
+  const struct frontend_iov* fiov = (const struct frontend_iov*)pa;
+  for (uint64_t i = 0; i < cnt && i < FRONTEND_IOV_MAX; i++)
+  {
+    iov[i].iov_base = (void*)fiov[i].base;
+    iov[i].iov_len = fiov[i].len;
+  }
+  return iov;
+}
+
+static long host_fstat(int fd, struct frontend_stat* fs)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+
+  memset(fs, 0, sizeof(*fs));
+  fs->dev = st.st_dev;
+  fs->ino = st.st_ino;
+  fs->mode = st.st_mode;
+  fs->nlink = st.st_nlink;
+  fs->uid = st.st_uid;
+  fs->gid = st.st_gid;
+  fs->rdev = st.st_rdev;
+  fs->size = st.st_size;
+  fs->blksize = st.st_blksize;
+  fs->blocks = st.st_blocks;
+  fs->atime = st.st_atime;
+  fs->mtime = st.st_mtime;
+  fs->ctime = st.st_ctime;
+  return 0;
+}
+
+static long serve_syscall(volatile uint64_t* m)
+{
+  long ret;
+  int cnt = m[3] < FRONTEND_IOV_MAX ? m[3] : FRONTEND_IOV_MAX;
+
+  switch (m[0])
+  {
+    case SYS_openat:
+      ret = openat(host_dirfd(m[1]), host_path(m[2]), m[4], m[5]);
+      break;
+    case SYS_close:
+      ret = close(m[1]);
+      break;
+    case SYS_read:
+      ret = read(m[1], (void*)m[2], m[3]);
+      break;
+    case SYS_write:
+      ret = write(m[1], (void*)m[2], m[3]);
+      break;
+    case SYS_pread:
+      ret = pread(m[1], (void*)m[2], m[3], m[4]);
+      break;
+    case SYS_pwrite:
+      ret = pwrite(m[1], (void*)m[2], m[3], m[4]);
+      break;
+    case SYS_readv:
+      ret = readv(m[1], host_iov(m[2], cnt), cnt);
+      break;
+    case SYS_writev:
+      ret = writev(m[1], host_iov(m[2], cnt), cnt);
+      break;
+    case SYS_preadv:
+      ret = preadv(m[1], host_iov(m[2], cnt), cnt, m[4]);
+      break;
+    case SYS_pwritev:
+      ret = pwritev(m[1], host_iov(m[2], cnt), cnt, m[4]);
+      break;
+    case SYS_lseek:
+      ret = lseek(m[1], m[2], m[3]);
+      break;
+    case SYS_fstat:
+      ret = host_fstat(m[1], (struct frontend_stat*)m[2]);
+      break;
+    case SYS_exit:
+      exit(m[1]);
+    default:
+      errno = ENOSYS;
+      ret = -1;
+  }
+
+  return ret < 0 ? -errno : ret;
+}
+
+static void* host_thread(void* arg)
+{
+  while (1)
+  {
+    uint64_t th = __atomic_load_n(&tohost, __ATOMIC_ACQUIRE);
+    if (!th)
+      continue;
+    __atomic_store_n(&tohost, 0, __ATOMIC_RELEASE);
+
+    uint64_t dev = FROMHOST_DEV(th), cmd = FROMHOST_CMD(th);
+    uint64_t payload = FROMHOST_DATA(th);
+
+    if (dev == 1 && cmd == 1)
+    {
+      fputc(payload & 0xff, stdout);
+      continue;
+    }
+    if (dev != 0 || cmd != 0)
+    {
+      fprintf(stderr, "hostfe: unsupported request dev %lu cmd %lu\n",
+              (unsigned long)dev, (unsigned long)cmd);
+      exit(1);
+    }
+
+    uint64_t t0 = now_ns();
+    volatile uint64_t* m = (volatile uint64_t*)payload;
+    m[0] = serve_syscall(m);
+    while (now_ns() - t0 < latency_ns)
+      ;
+
+    // Like fesvr, only answer once the previous answer has been taken
+    while (__atomic_load_n(&fromhost, __ATOMIC_ACQUIRE))
+      ;
+    __atomic_store_n(&fromhost, TOHOST_CMD(0, 0, 1), __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// The benchmarks
+
+#define BENCH_FILE "hostfe.dat"
+#define BENCH_BLOCK 4096
+
+static char bench_buf[FRONTEND_RING_SIZE][BENCH_BLOCK];
+
+static void report(const char* name, long iters, uint64_t ns)
+{
+  printf("%-24s %8ld ops %10.0f ns/op %12.0f ops/s\n", name, iters,
+         (double)ns / iters, iters * 1e9 / ns);
+}
+
+static long check(const char* what, long ret)
+{
+  if (ret < 0)
+  {
+    fprintf(stderr, "hostfe: %s failed: %s\n", what, strerror(-ret));
+    exit(1);
+  }
+  return ret;
+}
+
+static void run_benchmarks(long iters)
+{
+  const char* fn = BENCH_FILE;
+  struct frontend_stat st;
+  uint64_t t0;
+
+  long fd = check("open", frontend_syscall(SYS_openat, AT_FDCWD, va2pa(fn), strlen(fn) + 1,
+                                           O_RDWR | O_CREAT | O_TRUNC, 0644, 0, 0));
+  for (int i = 0; i < FRONTEND_RING_SIZE; i++)
+    check("write", frontend_syscall(SYS_pwrite, fd, va2pa(bench_buf[i]), BENCH_BLOCK,
+                                    i * BENCH_BLOCK, 0, 0, 0));
+
+  t0 = now_ns();
+  for (long i = 0; i < iters; i++)
+    check("fstat", frontend_syscall(SYS_fstat, fd, va2pa(&st), 0, 0, 0, 0, 0));
+  report("fstat", iters, now_ns() - t0);
+
+  t0 = now_ns();
+  for (long i = 0; i < iters; i++)
+  {
+    long f = check("open", frontend_syscall(SYS_openat, AT_FDCWD, va2pa(fn), strlen(fn) + 1,
+                                            O_RDONLY, 0, 0, 0));
+    frontend_syscall(SYS_close, f, 0, 0, 0, 0, 0, 0);
+  }
+  report("open+close", iters, now_ns() - t0);
+
+  t0 = now_ns();
+  for (long i = 0; i < iters; i++)
+    check("pread", frontend_syscall(SYS_pread, fd, va2pa(bench_buf[0]), BENCH_BLOCK,
+                                    (i % FRONTEND_RING_SIZE) * BENCH_BLOCK, 0, 0, 0));
+  report("pread 4K", iters, now_ns() - t0);
+
+  t0 = now_ns();
+  for (long i = 0; i < iters; i++)
+    check("pwrite", frontend_syscall(SYS_pwrite, fd, va2pa(bench_buf[0]), BENCH_BLOCK,
+                                     (i % FRONTEND_RING_SIZE) * BENCH_BLOCK, 0, 0, 0));
+  report("pwrite 4K", iters, now_ns() - t0);
+
+  // Keep the ring full to measure how much of the round trip overlaps
+  long tags[FRONTEND_RING_SIZE];
+  long batches = (iters + FRONTEND_RING_SIZE - 1) / FRONTEND_RING_SIZE;
+  t0 = now_ns();
+  for (long b = 0; b < batches; b++)
+  {
+    for (int i = 0; i < FRONTEND_RING_SIZE; i++)
+      tags[i] = frontend_syscall_submit(SYS_pread, fd, va2pa(bench_buf[i]), BENCH_BLOCK,
+                                        i * BENCH_BLOCK, 0, 0, 0);
+    for (int i = 0; i < FRONTEND_RING_SIZE; i++)
+      check("pread", frontend_syscall_reap(tags[i]));
+  }
+  report("pread 4K (ring)", batches * FRONTEND_RING_SIZE, now_ns() - t0);
+
+  frontend_syscall(SYS_close, fd, 0, 0, 0, 0, 0, 0);
+  unlinkat(root_fd, BENCH_FILE, 0);
+}
+
+int main(int argc, char** argv)
+{
+  const char* dir = ".";
+  long iters = 10000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:l:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd': dir = optarg; break;
+      case 'l': latency_ns = atol(optarg); break;
+      case 'n': iters = atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d dir] [-l latency_ns] [-n iterations]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if ((root_fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+  {
+    perror(dir);
+    return 1;
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    fprintf(stderr, "hostfe: warning: only one CPU, results will be dominated by scheduling\n");
+
+  pthread_t host;
+  pthread_create(&host, NULL, host_thread, NULL);
+
+  printf("hostfe: %ld iterations, %ld ns injected latency\n", iters, latency_ns);
+  run_benchmarks(iters);
+  return 0;
+}
@@ -0,0 +1,247 @@
+#include "disk_cache.h"
+#include "htif.h"
+#include "mtrap.h"
+#include "vm.h"
+#include "fdt.h"
+#include "atomic.h"
+#include "bits.h"
+#include <string.h>
+#include <errno.h>
+
+#ifdef PK_ENABLE_DISK_CACHE
+
+// Blocks are found through a hash of chains and kept on an LRU list, both
+// linked by index; -1 ends a list
+struct disk_cache_entry {
+  uint64_t block;
+  int32_t prev, next; // LRU order, most recent first
+  int32_t hnext;
+};
+
+#define DISK_CACHE_HASH(block) ((block) % DISK_CACHE_BLOCKS)
+
+static struct disk_cache_entry entries[DISK_CACHE_BLOCKS];
+static int32_t hash_heads[DISK_CACHE_BLOCKS];
+static int32_t lru_head = -1, lru_tail = -1;
+static char* cache_data;
+static int32_t cache_blocks; // at most DISK_CACHE_BLOCKS
+static spinlock_t disk_cache_lock = SPINLOCK_INIT;
+
+static uint64_t disk_blocks; // reads past the end of the disk are clamped
+static uint64_t disk_bytes;
+static uint64_t next_sequential;
+
+static char* entry_data(int32_t e)
+{
+  return cache_data + (size_t)e * DISK_CACHE_BLOCK;
+}
+
+static void lru_unlink(int32_t e)
+{
+  if (entries[e].prev >= 0) entries[entries[e].prev].next = entries[e].next;
+  else lru_head = entries[e].next;
+  if (entries[e].next >= 0) entries[entries[e].next].prev = entries[e].prev;
+  else lru_tail = entries[e].prev;
+}
+
+static void lru_push(int32_t e)
+{
+  entries[e].prev = -1;
+  entries[e].next = lru_head;
+  if (lru_head >= 0) entries[lru_head].prev = e;
+  else lru_tail = e;
+  lru_head = e;
+}
+
+static void hash_remove(int32_t e)
+{
+  int32_t* p = &hash_heads[DISK_CACHE_HASH(entries[e].block)];
+  while (*p != e)
+    p = &entries[*p].hnext;
+  *p = entries[e].hnext;
+}
+
+static void hash_insert(int32_t e)
+{
+  int32_t* head = &hash_heads[DISK_CACHE_HASH(entries[e].block)];
+  entries[e].hnext = *head;
+  *head = e;
+}
+
+static int32_t lookup(uint64_t block)
+{
+  int32_t e = hash_heads[DISK_CACHE_HASH(block)];
+  while (e >= 0 && entries[e].block != block)
+    e = entries[e].hnext;
+  return e;
+}
+
+static void disk_cache_prop(const struct fdt_scan_prop *prop, void *extra)
+{
+  const struct fdt_scan_node *node = prop->node;
+  if (strcmp(node->name, "chosen") || !node->parent || node->parent->parent) return;
+
+  if (!strcmp(prop->name, "pk,disk-cache-size")) {
+    uint64_t* size = (uint64_t*)extra;
+    if (prop->len == 8)
+      *size = ((uint64_t)__builtin_bswap32(prop->value[0]) << 32) |
+              __builtin_bswap32(prop->value[1]);
+    else
+      *size = __builtin_bswap32(prop->value[0]);
+  }
+}
+
+// /chosen may shrink the cache, or turn it off, with pk,disk-cache-size
+static size_t query_disk_cache_size(uintptr_t fdt)
+{
+  struct fdt_cb cb;
+  uint64_t size = DISK_CACHE_SIZE;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.prop = disk_cache_prop;
+  cb.extra = &size;
+  fdt_scan_path(fdt, "/chosen", &cb);
+  return ROUNDDOWN(MIN(size, DISK_CACHE_SIZE), MEGAPAGE_SIZE);
+}
+
+uintptr_t disk_cache_init(uintptr_t mem_size, uintptr_t fdt)
+{
+  _Static_assert(DISK_CACHE_SIZE % MEGAPAGE_SIZE == 0, "DISK_CACHE_SIZE must be in megapages");
+  size_t size = query_disk_cache_size(fdt);
+  if (!size)
+    return mem_size;
+  disk_bytes = htif_disk_size();
+  disk_blocks = (disk_bytes + DISK_CACHE_BLOCK - 1) / DISK_CACHE_BLOCK;
+
+  // The initrd has already been loaded, so go below it if the top of memory
+  // would overlap it
+  uintptr_t top = DRAM_BASE + mem_size;
+  if (initrd_end > top - size && initrd_start < top)
+    top = ROUNDDOWN(initrd_start, MEGAPAGE_SIZE);
+  if (!disk_bytes || top < DRAM_BASE + 2 * size)
+    return mem_size;
+
+  cache_data = (char*)top - size;
+  cache_blocks = size / DISK_CACHE_BLOCK;
+
+  // Every entry starts on the LRU list, holding no block
+  memset(hash_heads, -1, sizeof(hash_heads));
+  for (int32_t e = 0; e < cache_blocks; e++) {
+    entries[e].block = -1;
+    entries[e].hnext = -1;
+    lru_push(e);
+  }
+  return (uintptr_t)cache_data - DRAM_BASE;
+}
+
+// Read block, and the next few if the miss continues a sequential run,
+// into the least recently used entries. The reads are all posted before
+// any is waited for.
+static int32_t fill(uint64_t block)
+{
+  uint64_t count = block == next_sequential ? 1 + DISK_CACHE_READAHEAD : 1;
+  count = MIN(count, disk_blocks - block);
+
+  uint32_t tags = 0;
+  int32_t first = -1;
+  for (uint64_t b = block; b < block + count; b++) {
+    if (b != block && lookup(b) >= 0)
+      continue;
+
+    int32_t e = lru_tail;
+    uint64_t off = b * DISK_CACHE_BLOCK;
+    size_t len = MIN(DISK_CACHE_BLOCK, disk_bytes - off);
+    int tag = htif_disk_start(0, (uintptr_t)entry_data(e), off, len);
+    // Nothing is held yet for the block asked for, so it can wait for a tag
+    while (tag == -EBUSY && b == block)
+      tag = htif_disk_start(0, (uintptr_t)entry_data(e), off, len);
+    if (tag < 0) {
+      if (b == block) return -1;
+      break;
+    }
+    tags |= 1U << tag;
+    if (len < DISK_CACHE_BLOCK)
+      memset(entry_data(e) + len, 0, DISK_CACHE_BLOCK - len);
+
+    if (entries[e].block != (uint64_t)-1)
+      hash_remove(e);
+    entries[e].block = b;
+    hash_insert(e);
+    lru_unlink(e);
+    lru_push(e);
+    if (b == block)
+      first = e;
+  }
+
+  htif_disk_wait(tags);
+  return first;
+}
+
+int disk_cache_read(uintptr_t addr, uintptr_t offset, size_t size)
+{
+  if (!cache_data)
+    return htif_disk_read(addr, offset, size);
+
+  spinlock_lock(&disk_cache_lock);
+
+  if (offset >= disk_bytes) {
+    spinlock_unlock(&disk_cache_lock);
+    return -EINVAL;
+  }
+  size = MIN(size, disk_bytes - offset);
+
+  while (size) {
+    uint64_t block = offset / DISK_CACHE_BLOCK;
+    size_t skip = offset % DISK_CACHE_BLOCK;
+    size_t n = MIN(size, DISK_CACHE_BLOCK - skip);
+
+    int32_t e = lookup(block);
+    if (e < 0 && (e = fill(block)) < 0) {
+      spinlock_unlock(&disk_cache_lock);
+      return htif_disk_read(addr, offset, size);
+    }
+    lru_unlink(e);
+    lru_push(e);
+    memcpy((void*)addr, entry_data(e) + skip, n);
+    next_sequential = block + 1;
+
+    addr += n;
+    offset += n;
+    size -= n;
+  }
+
+  spinlock_unlock(&disk_cache_lock);
+  return 0;
+}
+
+// Copy new data into any cached blocks it covers; blocks are not allocated
+// on write
+void disk_cache_update(uintptr_t addr, uintptr_t offset, size_t size)
+{
+  if (!cache_data)
+    return;
+
+  spinlock_lock(&disk_cache_lock);
+  while (size) {
+    uint64_t block = offset / DISK_CACHE_BLOCK;
+    size_t skip = offset % DISK_CACHE_BLOCK;
+    size_t n = MIN(size, DISK_CACHE_BLOCK - skip);
+
+    int32_t e = lookup(block);
+    if (e >= 0)
+      memcpy(entry_data(e) + skip, (void*)addr, n);
+
+    addr += n;
+    offset += n;
+    size -= n;
+  }
+  spinlock_unlock(&disk_cache_lock);
+}
+
+int disk_cache_write(uintptr_t addr, uintptr_t offset, size_t size)
+{
+  disk_cache_update(addr, offset, size);
+  return htif_disk_write(addr, offset, size);
+}
+
+#endif
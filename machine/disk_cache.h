@@ -0,0 +1,24 @@
+#ifndef _RISCV_DISK_CACHE_H
+#define _RISCV_DISK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Write-through cache of the HTIF disk, kept in memory carved off the top of
+// the bank we run from (or from below the initrd, if that is in the way) and
+// hidden from the payload. Override the size with -DDISK_CACHE_SIZE=...; it
+// must be a multiple of MEGAPAGE_SIZE. At boot, a pk,disk-cache-size property
+// in /chosen can make it smaller, or 0 to turn it off.
+#ifndef DISK_CACHE_SIZE
+# define DISK_CACHE_SIZE (8 << 20)
+#endif
+#define DISK_CACHE_BLOCK 4096
+#define DISK_CACHE_BLOCKS (DISK_CACHE_SIZE / DISK_CACHE_BLOCK)
+#define DISK_CACHE_READAHEAD 8 // blocks fetched ahead of a sequential miss
+
+uintptr_t disk_cache_init(uintptr_t mem_size, uintptr_t fdt);
+int disk_cache_read(uintptr_t addr, uintptr_t offset, size_t size);
+int disk_cache_write(uintptr_t addr, uintptr_t offset, size_t size);
+void disk_cache_update(uintptr_t addr, uintptr_t offset, size_t size);
+
+#endif
@@ -3,8 +3,73 @@
 #include "config.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "atomic.h"
+#include "emulation_profile.h"
 #include <limits.h>
 
+#if DECODE_CACHE_SIZE
+// An instruction that traps over and over in a loop is only fetched and
+// decoded the first time. Entries belong to the address space they were
+// fetched from, and only live until the next SBI_REMOTE_FENCE_I, which bumps
+// the generation. Nothing else is seen from M-mode: a local fence.i or
+// sfence.vma doesn't trap, and an address space can be torn down and its satp
+// reused. Hence the cache is off unless the supervisor promises to rewrite
+// code and recycle address spaces only behind SBI_REMOTE_FENCE_I.
+typedef struct {
+  uintptr_t pc;
+  uintptr_t satp;
+  insn_t insn;
+  emulation_func f;
+  uint32_t gen;
+} decoded_insn_t;
+
+static decoded_insn_t decode_cache[MAX_HARTS][DECODE_CACHE_SIZE];
+static uint32_t decode_gen = 1;
+#endif
+
+void decode_cache_flush()
+{
+#if DECODE_CACHE_SIZE
+  atomic_add(&decode_gen, 1);
+#endif
+}
+
+static inline emulation_func decode(insn_t insn)
+{
+  extern uint32_t illegal_insn_trap_table[];
+  uint32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
+  return (emulation_func)(uintptr_t)*pf;
+}
+
+// Fetch the instruction at pc and its emulation routine, through the cache
+static insn_t fetch_insn(uintptr_t pc, uintptr_t* mstatus, emulation_func* f)
+{
+#if DECODE_CACHE_SIZE
+  decoded_insn_t* e = &decode_cache[read_const_csr(mhartid)][(pc / 2) % DECODE_CACHE_SIZE];
+  uintptr_t satp = read_csr(satp);
+  uint32_t gen = atomic_read(&decode_gen);
+  if (e->gen == gen && e->pc == pc && e->satp == satp) {
+    *mstatus = read_csr(mstatus);
+    *f = e->f;
+    return e->insn;
+  }
+#endif
+
+  insn_t insn = get_insn(pc, mstatus);
+  *f = decode(insn);
+
+#if DECODE_CACHE_SIZE
+  if ((insn & 3) == 3) {
+    e->pc = pc;
+    e->satp = satp;
+    e->insn = insn;
+    e->f = *f;
+    e->gen = gen;
+  }
+#endif
+  return insn;
+}
+
 static DECLARE_EMULATION_FUNC(emulate_rvc)
 {
 #ifdef __riscv_compressed
@@ -130,20 +195,99 @@ void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 
   uintptr_t mstatus = read_csr(mstatus);
   insn_t insn = read_csr(mbadaddr);
+  emulation_func f;
 
   if (unlikely((insn & 3) != 3)) {
     if (insn == 0)
-      insn = get_insn(mepc, &mstatus);
+      insn = fetch_insn(mepc, &mstatus, &f);
     if ((insn & 3) != 3)
       return emulate_rvc(regs, mcause, mepc, mstatus, insn);
+  } else {
+    f = decode(insn);
   }
 
   write_csr(mepc, mepc + 4);
-
-  extern uint32_t illegal_insn_trap_table[];
-  uint32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
-  emulation_func f = (emulation_func)(uintptr_t)*pf;
   f(regs, mcause, mepc, mstatus, insn);
+
+  emulate_following(regs, mepc);
+}
+
+// Whether insn would raise an illegal instruction trap that
+// illegal_insn_trap_table emulates. Instructions the hart runs natively must
+// never get here: their opcodes' emulation routines reject them as illegal.
+static inline int chainable(insn_t insn)
+{
+  if ((insn & 3) != 3)
+    return 0;
+
+  switch (insn & 0x7f)
+  {
+#if !defined(__riscv_muldiv)
+    case 0x33: // OP
+# if __riscv_xlen >= 64
+    case 0x3b: // OP-32
+# endif
+      return ((insn >> 25) & 0x7f) == 1; // MUL/DIV
+#endif
+#if !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
+    case 0x07: // LOAD-FP
+    case 0x27: // STORE-FP
+    case 0x43: // MADD
+    case 0x47: // MSUB
+    case 0x4b: // NMSUB
+    case 0x4f: // NMADD
+    case 0x53: // OP-FP
+      return 1;
+#endif
+  }
+  return 0;
+}
+
+// Having emulated one instruction, go on to emulate the ones after it for
+// as long as they would trap too, saving a trap entry and exit for each.
+// Stop at the first instruction the hart can run (which covers all control
+// transfers), at the end of the page, if an interrupt is pending, or after
+// EMULATION_CHAIN_MAX instructions in all for the trap.
+//
+// Emulation routines call back into the misaligned handlers, which end here
+// too; only the outermost call chains, so the M-mode stack stays bounded.
+static volatile char chaining[MAX_HARTS];
+
+void emulate_following(uintptr_t* regs, uintptr_t mepc)
+{
+  uintptr_t page = mepc >> RISCV_PGSHIFT;
+  volatile char* busy = &chaining[read_const_csr(mhartid)];
+  if (*busy)
+    return;
+  *busy = 1;
+
+  for (int n = 0; n < EMULATION_CHAIN_MAX; n++) {
+    uintptr_t pc = read_csr(mepc), mstatus;
+    if ((pc >> RISCV_PGSHIFT) != page || (pc & (RISCV_PGSIZE - 1)) > RISCV_PGSIZE - 4)
+      break;
+    if (read_csr(mip) & read_csr(mie))
+      break;
+
+    emulation_func f;
+    insn_t insn = fetch_insn(pc, &mstatus, &f);
+    if (!chainable(insn))
+      break;
+
+    // Should it be rejected after all, it is reported as the trap it would
+    // have raised, whatever brought us here
+    write_csr(mcause, CAUSE_ILLEGAL_INSTRUCTION);
+    write_csr(mepc, pc + 4);
+    f(regs, CAUSE_ILLEGAL_INSTRUCTION, pc, mstatus, insn);
+    emulation_profile_chained(pc);
+  }
+
+  *busy = 0;
+}
+
+// A redirected trap unwinds the M-mode stack, ending any chain in progress
+void emulate_following_cancel()
+{
+  chaining[read_const_csr(mhartid)] = 0;
 }
 
 __attribute__((noinline))
@@ -9,6 +9,22 @@ typedef uintptr_t insn_t;
 typedef void (*emulation_func)(uintptr_t*, uintptr_t, uintptr_t, uintptr_t, insn_t);
 #define DECLARE_EMULATION_FUNC(name) void name(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc, uintptr_t mstatus, insn_t insn)
 
+// Most instructions emulated back to back after one trap; 0 disables
+#ifndef EMULATION_CHAIN_MAX
+# define EMULATION_CHAIN_MAX 16
+#endif
+
+// Recently emulated instructions remembered per hart; a power of 2, 0 disables.
+// Only safe if every code change and satp reuse is followed by an
+// SBI_REMOTE_FENCE_I (see emulation.c).
+#ifndef DECODE_CACHE_SIZE
+# define DECODE_CACHE_SIZE 0
+#endif
+
+void decode_cache_flush();
+void emulate_following(uintptr_t* regs, uintptr_t mepc);
+void emulate_following_cancel();
+void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
 void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
 void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
 void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr);
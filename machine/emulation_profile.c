@@ -0,0 +1,138 @@
+#include "emulation_profile.h"
+#include "emulation.h"
+#include "mtrap.h"
+#include "encoding.h"
+#include <string.h>
+
+#ifdef PK_ENABLE_EMULATION_PROFILE
+
+#define PROFILED_CAUSES (CAUSE_MISALIGNED_STORE + 1)
+
+typedef struct {
+  uint64_t traps;
+  uint64_t insns;  // including those emulated in the same trap
+  uint64_t cycles; // from entry to the handler to return
+} cause_prof_t;
+
+typedef struct {
+  uintptr_t pc;
+  uintptr_t cause;
+  uint64_t count;
+} pc_prof_t;
+
+typedef struct {
+  cause_prof_t cause[PROFILED_CAUSES];
+  pc_prof_t pc[EMULATION_PROFILE_SLOTS];
+  uint64_t lost; // instructions whose pc found the table full
+} emulation_prof_t;
+
+static emulation_prof_t emulation_prof[MAX_HARTS];
+
+static const char* const cause_names[PROFILED_CAUSES] = {
+  [CAUSE_ILLEGAL_INSTRUCTION] = "illegal instruction",
+  [CAUSE_MISALIGNED_LOAD] = "misaligned load",
+  [CAUSE_MISALIGNED_STORE] = "misaligned store",
+};
+
+static void count_pc(emulation_prof_t* p, uintptr_t cause, uintptr_t pc)
+{
+  p->cause[cause].insns++;
+
+  for (size_t i = 0; i < EMULATION_PROFILE_SLOTS; i++)
+  {
+    pc_prof_t* s = &p->pc[(pc / 2 + i) % EMULATION_PROFILE_SLOTS];
+    if (s->count == 0)
+    {
+      s->pc = pc;
+      s->cause = cause;
+    }
+    if (s->pc == pc)
+    {
+      s->count++;
+      return;
+    }
+  }
+  p->lost++;
+}
+
+void emulation_profile_chained(uintptr_t mepc)
+{
+  count_pc(&emulation_prof[read_const_csr(mhartid)], CAUSE_ILLEGAL_INSTRUCTION, mepc);
+}
+
+// Stand in for the emulating trap handlers in trap_table. A trap that is
+// redirected to the OS doesn't return here, so it isn't counted.
+#define PROFILED_TRAP(handler) \
+  void profiled_##handler(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc) \
+  { \
+    uintptr_t cycle0 = read_csr(mcycle); \
+    handler(regs, mcause, mepc); \
+    emulation_prof_t* p = &emulation_prof[read_const_csr(mhartid)]; \
+    p->cause[mcause].traps++; \
+    p->cause[mcause].cycles += read_csr(mcycle) - cycle0; \
+    count_pc(p, mcause, mepc); \
+  }
+
+PROFILED_TRAP(illegal_insn_trap)
+PROFILED_TRAP(misaligned_load_trap)
+PROFILED_TRAP(misaligned_store_trap)
+
+static void print_hart(uintptr_t hart, emulation_prof_t* p)
+{
+  printm("emulation profile, hart %d\n", (int)hart);
+  printm("cause,traps,insns,cycles\n");
+  for (uintptr_t c = 0; c < PROFILED_CAUSES; c++)
+    if (p->cause[c].traps)
+      printm("%s,%ld,%ld,%ld\n", cause_names[c], p->cause[c].traps,
+             p->cause[c].insns, p->cause[c].cycles);
+
+  // Selecting the top few by repeated passes beats sorting the table in place,
+  // which would break its probe sequences
+  printm("pc,cause,count\n");
+  uint64_t bound = UINT64_MAX;
+  for (int n = 0; n < EMULATION_PROFILE_TOP; )
+  {
+    pc_prof_t* top = NULL;
+    for (pc_prof_t* s = p->pc; s < p->pc + EMULATION_PROFILE_SLOTS; s++)
+      if (s->count && s->count < bound && (!top || s->count > top->count))
+        top = s;
+    if (!top)
+      break;
+
+    // Print the pcs tied with this count, then move on below it
+    for (pc_prof_t* s = p->pc; s < p->pc + EMULATION_PROFILE_SLOTS && n < EMULATION_PROFILE_TOP; s++)
+    {
+      if (s->count == top->count)
+      {
+        printm("%lx,%s,%ld\n", s->pc, cause_names[s->cause], s->count);
+        n++;
+      }
+    }
+    bound = top->count;
+  }
+  if (p->lost)
+    printm("%ld instructions at untracked pcs\n", p->lost);
+}
+
+void emulation_profile_print()
+{
+  for (uintptr_t hart = 0; hart < MAX_HARTS; hart++)
+  {
+    emulation_prof_t* p = &emulation_prof[hart];
+    for (uintptr_t c = 0; c < PROFILED_CAUSES; c++)
+    {
+      if (p->cause[c].traps)
+      {
+        print_hart(hart, p);
+        break;
+      }
+    }
+  }
+}
+
+void emulation_profile_reset()
+{
+  memset(emulation_prof, 0, sizeof(emulation_prof));
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _RISCV_EMULATION_PROFILE_H
+#define _RISCV_EMULATION_PROFILE_H
+
+#include "config.h"
+#include <stdint.h>
+
+// Per-hart counts of the traps machine mode emulated and the cycles spent on
+// them, by cause and by pc, to find the code worth rebuilding for this
+// hardware. Printed at poweroff and on SBI_EMULATION_PROFILE.
+#define EMULATION_PROFILE_SLOTS 256 // pcs tracked per hart
+#define EMULATION_PROFILE_TOP 16    // pcs printed per hart
+
+#ifdef PK_ENABLE_EMULATION_PROFILE
+void emulation_profile_chained(uintptr_t mepc);
+void emulation_profile_print();
+void emulation_profile_reset();
+#else
+static inline void emulation_profile_chained(uintptr_t mepc) {}
+static inline void emulation_profile_print() {}
+static inline void emulation_profile_reset() {}
+#endif
+
+#endif
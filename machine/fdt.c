@@ -25,20 +25,21 @@ static inline int isstring(char c)
   return 0;
 }
 
+static uint32_t *fdt_scan_node(
+  uint32_t *lex,
+  const char *strings,
+  const struct fdt_scan_node *parent,
+  const struct fdt_cb *cb);
+
 static uint32_t *fdt_scan_helper(
   uint32_t *lex,
   const char *strings,
   struct fdt_scan_node *node,
   const struct fdt_cb *cb)
 {
-  struct fdt_scan_node child;
   struct fdt_scan_prop prop;
   int last = 0;
 
-  child.parent = node;
-  // these are the default cell counts, as per the FDT spec
-  child.address_cells = 2;
-  child.size_cells = 1;
   prop.node = node;
 
   while (1) {
@@ -59,17 +60,9 @@ static uint32_t *fdt_scan_helper(
         break;
       }
       case FDT_BEGIN_NODE: {
-        uint32_t *lex_next;
         if (!last && node && cb->done) cb->done(node, cb->extra);
         last = 1;
-        child.name = (const char *)(lex+1);
-        if (cb->open) cb->open(&child, cb->extra);
-        lex_next = fdt_scan_helper(
-          lex + 2 + strlen(child.name)/4,
-          strings, &child, cb);
-        if (cb->close && cb->close(&child, cb->extra) == -1)
-          while (lex != lex_next) *lex++ = bswap(FDT_NOP);
-        lex = lex_next;
+        lex = fdt_scan_node(lex, strings, node, cb);
         break;
       }
       case FDT_END_NODE: {
@@ -84,6 +77,31 @@ static uint32_t *fdt_scan_helper(
   }
 }
 
+// Scan the node whose FDT_BEGIN_NODE is at lex, and its children
+static uint32_t *fdt_scan_node(
+  uint32_t *lex,
+  const char *strings,
+  const struct fdt_scan_node *parent,
+  const struct fdt_cb *cb)
+{
+  struct fdt_scan_node node;
+  uint32_t *lex_next;
+
+  node.parent = parent;
+  node.name = (const char *)(lex+1);
+  // these are the default cell counts, as per the FDT spec
+  node.address_cells = 2;
+  node.size_cells = 1;
+
+  if (cb->open) cb->open(&node, cb->extra);
+  lex_next = fdt_scan_helper(
+    lex + 2 + strlen(node.name)/4,
+    strings, &node, cb);
+  if (cb->close && cb->close(&node, cb->extra) == -1)
+    while (lex != lex_next) *lex++ = bswap(FDT_NOP);
+  return lex_next;
+}
+
 void fdt_scan(uintptr_t fdt, const struct fdt_cb *cb)
 {
   struct fdt_header *header = (struct fdt_header *)fdt;
@@ -137,6 +155,280 @@ int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str)
   return -1;
 }
 
+//////////////////////////////////////////// NODE INDEX //////////////////////////////////////////
+
+// One pass over the blob records where each node starts and what it is, so
+// that the queries and filters only visit the nodes they are after. Offsets
+// are in words from the start of the structure block. Nodes deleted by a
+// filter since are recognised by their FDT_BEGIN_NODE having become NOPs.
+#define FDT_INDEX_MAX_NODES 256
+#define FDT_INDEX_MAX_DEPTH 16
+
+struct fdt_index_node {
+  uint32_t offset;
+  uint32_t compatible;  // offset of the property, 0 if none
+  uint32_t device_type; // likewise
+  int16_t parent;       // -1 for the root
+  uint8_t depth;
+  uint8_t address_cells;
+  uint8_t size_cells;
+};
+
+static struct {
+  uintptr_t fdt;        // the blob indexed, 0 if none
+  uint32_t struct_size; // its size_dt_struct, still big-endian
+  int nodes;            // -1 if the blob can't be indexed
+  struct fdt_index_node node[FDT_INDEX_MAX_NODES];
+} fdt_index;
+
+static uint32_t *fdt_struct(uintptr_t fdt)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  return (uint32_t *)(fdt + bswap(header->off_dt_struct));
+}
+
+static int fdt_index_build(uintptr_t fdt)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  const char *strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  uint32_t *start = fdt_struct(fdt);
+  uint32_t *lex = start;
+  int16_t stack[FDT_INDEX_MAX_DEPTH];
+  int depth = 0, n = 0;
+
+  if (bswap(header->magic) != FDT_MAGIC ||
+      bswap(header->last_comp_version) > FDT_VERSION) return -1;
+
+  while (1) {
+    switch (bswap(*lex)) {
+      case FDT_BEGIN_NODE: {
+        if (n == FDT_INDEX_MAX_NODES || depth == FDT_INDEX_MAX_DEPTH) return -1;
+        struct fdt_index_node *node = &fdt_index.node[n];
+        memset(node, 0, sizeof(*node));
+        node->offset = lex - start;
+        node->parent = depth ? stack[depth-1] : -1;
+        node->depth = depth;
+        node->address_cells = 2;
+        node->size_cells = 1;
+        stack[depth++] = n++;
+        lex += 2 + strlen((const char *)(lex + 1))/4;
+        break;
+      }
+      case FDT_END_NODE: {
+        if (depth-- == 0) return -1;
+        lex += 1;
+        break;
+      }
+      case FDT_PROP: {
+        if (depth == 0) return -1;
+        struct fdt_index_node *node = &fdt_index.node[stack[depth-1]];
+        const char *name = strings + bswap(lex[2]);
+        if (!strcmp(name, "compatible")) node->compatible = lex - start;
+        else if (!strcmp(name, "device_type")) node->device_type = lex - start;
+        else if (!strcmp(name, "#address-cells")) node->address_cells = bswap(lex[3]);
+        else if (!strcmp(name, "#size-cells")) node->size_cells = bswap(lex[3]);
+        lex += 3 + (bswap(lex[1])+3)/4;
+        break;
+      }
+      case FDT_NOP: {
+        lex += 1;
+        break;
+      }
+      default: { // FDT_END
+        return n;
+      }
+    }
+  }
+}
+
+// Whether fdt is indexed, indexing it if it is not
+static int fdt_indexed(uintptr_t fdt)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  if (fdt_index.fdt != fdt || fdt_index.struct_size != header->size_dt_struct) {
+    fdt_index.fdt = fdt;
+    fdt_index.struct_size = header->size_dt_struct;
+    fdt_index.nodes = fdt_index_build(fdt);
+  }
+  return fdt_index.nodes >= 0;
+}
+
+// Scan the subtree rooted at node i, as a full scan would see it
+static void fdt_scan_indexed(uintptr_t fdt, int i, const struct fdt_cb *cb)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  const char *strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  uint32_t *start = fdt_struct(fdt);
+  const struct fdt_index_node *node = &fdt_index.node[i];
+  struct fdt_scan_node chain[FDT_INDEX_MAX_DEPTH];
+
+  if (bswap(start[node->offset]) != FDT_BEGIN_NODE) return; // deleted
+
+  for (int a = node->parent, d = node->depth - 1; a >= 0; a = fdt_index.node[a].parent, d--) {
+    chain[d].parent = d ? &chain[d-1] : 0;
+    chain[d].name = (const char *)(start + fdt_index.node[a].offset + 1);
+    chain[d].address_cells = fdt_index.node[a].address_cells;
+    chain[d].size_cells = fdt_index.node[a].size_cells;
+  }
+  fdt_scan_node(start + node->offset, strings, node->depth ? &chain[node->depth-1] : 0, cb);
+}
+
+// Scan every subtree rooted at a node that match() accepts, skipping matches
+// within those subtrees, which have been seen already
+static void fdt_scan_matching(
+  uintptr_t fdt,
+  int (*match)(const uint32_t *start, const struct fdt_index_node *node, const char *arg),
+  const char *arg,
+  const struct fdt_cb *cb)
+{
+  if (!fdt_indexed(fdt)) return fdt_scan(fdt, cb);
+
+  const uint32_t *start = fdt_struct(fdt);
+  for (int i = 0; i < fdt_index.nodes; ) {
+    const struct fdt_index_node *node = &fdt_index.node[i];
+    if (!match(start, node, arg)) {
+      i++;
+      continue;
+    }
+    fdt_scan_indexed(fdt, i, cb);
+    while (++i < fdt_index.nodes && fdt_index.node[i].depth > node->depth)
+      ;
+  }
+}
+
+static int match_compatible(const uint32_t *start, const struct fdt_index_node *node, const char *compat)
+{
+  struct fdt_scan_prop prop;
+  if (!node->compatible) return 0;
+  prop.value = (uint32_t *)(start + node->compatible + 3);
+  prop.len = bswap(start[node->compatible + 1]);
+  return fdt_string_list_index(&prop, compat) >= 0;
+}
+
+static int match_device_type(const uint32_t *start, const struct fdt_index_node *node, const char *type)
+{
+  return node->device_type && !strcmp((const char *)(start + node->device_type + 3), type);
+}
+
+// Match the node at the given path, where each component may leave off the
+// unit address
+static int match_path(const uint32_t *start, const struct fdt_index_node *node, const char *path)
+{
+  const struct fdt_index_node *n = node;
+  const char *end = path + strlen(path);
+
+  while (n->parent >= 0) {
+    const char *name = (const char *)(start + n->offset + 1);
+    const char *component = end;
+    while (component > path && component[-1] != '/') component--;
+    size_t len = end - component;
+    if (len == 0 || strncmp(name, component, len) || (name[len] && name[len] != '@'))
+      return 0;
+    end = component - 1;
+    n = &fdt_index.node[n->parent];
+  }
+  return end == path;
+}
+
+void fdt_scan_compatible(uintptr_t fdt, const char *compat, const struct fdt_cb *cb)
+{
+  fdt_scan_matching(fdt, match_compatible, compat, cb);
+}
+
+void fdt_scan_device_type(uintptr_t fdt, const char *type, const struct fdt_cb *cb)
+{
+  fdt_scan_matching(fdt, match_device_type, type, cb);
+}
+
+void fdt_scan_path(uintptr_t fdt, const char *path, const struct fdt_cb *cb)
+{
+  fdt_scan_matching(fdt, match_path, path, cb);
+}
+
+//////////////////////////////////////////// NODE INSERTION //////////////////////////////////////
+
+// Offset of the string in the strings block, appending it if it is new
+static uint32_t fdt_add_string(struct fdt_header *header, const char *str)
+{
+  char *strings = (char *)header + bswap(header->off_dt_strings);
+  uint32_t size = bswap(header->size_dt_strings);
+  uint32_t len = strlen(str) + 1;
+
+  for (uint32_t off = 0; off < size; off += strlen(strings + off) + 1)
+    if (!strcmp(strings + off, str))
+      return off;
+
+  // The strings block is last, so it can grow in place (into any padding
+  // first)
+  uint32_t end = bswap(header->off_dt_strings) + size + len;
+  memcpy(strings + size, str, len);
+  header->size_dt_strings = bswap(size + len);
+  if (end > bswap(header->totalsize))
+    header->totalsize = bswap(end);
+  return size;
+}
+
+void fdt_add_node(uintptr_t fdt, const char *name, const struct fdt_new_prop *props, int nprops)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  uint32_t *start = (uint32_t *)(fdt + bswap(header->off_dt_struct));
+  uint32_t *lex = start;
+  uint32_t *root_end = 0;
+  int depth = 0;
+
+  assert(bswap(header->off_dt_struct) < bswap(header->off_dt_strings));
+
+  // Find the root node's FDT_END_NODE; the new node goes just before it
+  while (!root_end) {
+    switch (bswap(*lex)) {
+      case FDT_BEGIN_NODE:
+        depth++;
+        lex += 1 + (strlen((const char *)(lex + 1)) + 4) / 4;
+        break;
+      case FDT_END_NODE:
+        if (--depth == 0) root_end = lex;
+        lex += 1;
+        break;
+      case FDT_PROP:
+        lex += 3 + (bswap(lex[1]) + 3) / 4;
+        break;
+      case FDT_NOP:
+        lex += 1;
+        break;
+      default:
+        assert(0);
+    }
+  }
+
+  uint32_t words = 2 + (strlen(name) + 4) / 4;
+  for (int i = 0; i < nprops; i++)
+    words += 3 + (props[i].len + 3) / 4;
+  uint32_t bytes = words * 4;
+
+  // Open a gap in the structure block, moving everything after it up
+  uintptr_t gap = (uintptr_t)root_end;
+  memmove((void *)(gap + bytes), (void *)gap, fdt + bswap(header->totalsize) - gap);
+  header->size_dt_struct = bswap(bswap(header->size_dt_struct) + bytes);
+  header->off_dt_strings = bswap(bswap(header->off_dt_strings) + bytes);
+  header->totalsize = bswap(bswap(header->totalsize) + bytes);
+
+  fdt_index.fdt = 0;
+
+  lex = root_end;
+  memset(lex, 0, bytes);
+  *lex++ = bswap(FDT_BEGIN_NODE);
+  strcpy((char *)lex, name);
+  lex += (strlen(name) + 4) / 4;
+  for (int i = 0; i < nprops; i++) {
+    *lex++ = bswap(FDT_PROP);
+    *lex++ = bswap(props[i].len);
+    *lex++ = bswap(fdt_add_string(header, props[i].name));
+    memcpy(lex, props[i].value, props[i].len);
+    lex += (props[i].len + 3) / 4;
+  }
+  *lex++ = bswap(FDT_END_NODE);
+}
+
 //////////////////////////////////////////// MEMORY SCAN /////////////////////////////////////////
 
 struct mem_scan {
@@ -193,7 +485,7 @@ void query_mem(uintptr_t fdt)
   cb.extra = &scan;
 
   mem_size = 0;
-  fdt_scan(fdt, &cb);
+  fdt_scan_device_type(fdt, "memory", &cb);
   assert (mem_size > 0);
 }
 
@@ -283,12 +575,71 @@ void query_harts(uintptr_t fdt)
   cb.close= hart_close;
   cb.extra = &scan;
 
-  fdt_scan(fdt, &cb);
+  fdt_scan_device_type(fdt, "cpu", &cb);
 
   // The current hart should have been detected
   assert ((hart_mask >> read_csr(mhartid)) != 0);
 }
 
+//////////////////////////////////////////// TIMEBASE SCAN ///////////////////////////////////////
+
+static void timebase_prop(const struct fdt_scan_prop *prop, void *extra)
+{
+  if (!strcmp(prop->name, "timebase-frequency")) {
+    if (prop->len == 8)
+      timebase_freq = ((uint64_t)bswap(prop->value[0]) << 32) | bswap(prop->value[1]);
+    else
+      timebase_freq = bswap(prop->value[0]);
+  }
+}
+
+void query_timebase(uintptr_t fdt)
+{
+  struct fdt_cb cb;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.prop = timebase_prop;
+
+  timebase_freq = 0;
+  fdt_scan_path(fdt, "/cpus", &cb);
+  if (!timebase_freq)
+    timebase_freq = DEFAULT_TIMEBASE_FREQ;
+}
+
+//////////////////////////////////////////// INITRD SCAN ////////////////////////////////////////
+
+static uint64_t initrd_prop_value(const struct fdt_scan_prop *prop)
+{
+  if (prop->len == 8)
+    return ((uint64_t)bswap(prop->value[0]) << 32) | bswap(prop->value[1]);
+  return bswap(prop->value[0]);
+}
+
+static void initrd_prop(const struct fdt_scan_prop *prop, void *extra)
+{
+  const struct fdt_scan_node *node = prop->node;
+  if (strcmp(node->name, "chosen") || !node->parent || node->parent->parent) return;
+
+  if (!strcmp(prop->name, "linux,initrd-start")) {
+    initrd_start = initrd_prop_value(prop);
+  } else if (!strcmp(prop->name, "linux,initrd-end")) {
+    initrd_end = initrd_prop_value(prop);
+  }
+}
+
+void query_initrd(uintptr_t fdt)
+{
+  struct fdt_cb cb;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.prop = initrd_prop;
+
+  initrd_start = initrd_end = 0;
+  fdt_scan_path(fdt, "/chosen", &cb);
+  if (initrd_end <= initrd_start)
+    initrd_start = initrd_end = 0;
+}
+
 ///////////////////////////////////////////// CLINT SCAN /////////////////////////////////////////
 
 struct clint_scan
@@ -362,7 +713,7 @@ void query_clint(uintptr_t fdt)
   cb.extra = &scan;
 
   scan.done = 0;
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, "riscv,clint0", &cb);
   assert (scan.done);
 }
 
@@ -464,7 +815,7 @@ void query_plic(uintptr_t fdt)
   cb.extra = &scan;
 
   scan.done = 0;
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, "riscv,plic0", &cb);
 }
 
 static void plic_redact(const struct fdt_scan_node *node, void *extra)
@@ -494,7 +845,7 @@ void filter_plic(uintptr_t fdt)
   cb.extra = &scan;
 
   scan.done = 0;
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, "riscv,plic0", &cb);
 }
 
 //////////////////////////////////////////// COMPAT SCAN ////////////////////////////////////////
@@ -545,7 +896,52 @@ void filter_compat(uintptr_t fdt, const char *compat)
   scan.compat = compat;
   scan.depth = 0;
   scan.kill = 999;
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, compat, &cb);
+}
+
+//////////////////////////////////////////// MEMORY FILTER //////////////////////////////////////
+
+struct mem_filter {
+  struct mem_scan scan; // first, as mem_open clears only this part
+  uint64_t size;
+};
+
+static void mem_shrink(const struct fdt_scan_node *node, void *extra)
+{
+  struct mem_filter *filter = (struct mem_filter *)extra;
+  uint32_t *value = (uint32_t *)filter->scan.reg_value;
+  const uint32_t *end = value + filter->scan.reg_len/4;
+  uintptr_t self = (uintptr_t)mem_shrink;
+
+  if (!filter->scan.memory) return;
+
+  while (end - value > 0) {
+    uint64_t base, size;
+    uint32_t *size_value = (uint32_t *)fdt_get_address(node->parent, value, &base);
+    value = (uint32_t *)fdt_get_size(node->parent, size_value, &size);
+    if (base <= self && self <= base + size) {
+      uint64_t new_size = filter->size;
+      for (int i = node->parent->size_cells - 1; i >= 0; i--) {
+        size_value[i] = bswap((uint32_t)new_size);
+        new_size >>= 32;
+      }
+    }
+  }
+}
+
+void filter_mem(uintptr_t fdt, uint64_t size)
+{
+  struct fdt_cb cb;
+  struct mem_filter filter;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.open = mem_open;
+  cb.prop = mem_prop;
+  cb.done = mem_shrink;
+  cb.extra = &filter;
+
+  filter.size = size;
+  fdt_scan_device_type(fdt, "memory", &cb);
 }
 
 //////////////////////////////////////////// HART FILTER ////////////////////////////////////////
@@ -623,7 +1019,7 @@ void filter_harts(uintptr_t fdt, long *disabled_hart_mask)
 
   filter.disabled_hart_mask = disabled_hart_mask;
   *disabled_hart_mask = 0;
-  fdt_scan(fdt, &cb);
+  fdt_scan_device_type(fdt, "cpu", &cb);
 }
 
 //////////////////////////////////////////// PRINT //////////////////////////////////////////////
@@ -47,6 +47,15 @@ struct fdt_cb {
 
 // Scan the contents of FDT
 void fdt_scan(uintptr_t fdt, const struct fdt_cb *cb);
+
+// Scan only the subtrees rooted at the nodes compatible with compat, of
+// device_type type, or at path (e.g. "/chosen"). They are found through an
+// index built in one pass and kept while the blob keeps its shape. If the
+// blob can't be indexed these scan it all, so callbacks must still check
+// what they are looking at.
+void fdt_scan_compatible(uintptr_t fdt, const char *compat, const struct fdt_cb *cb);
+void fdt_scan_device_type(uintptr_t fdt, const char *type, const struct fdt_cb *cb);
+void fdt_scan_path(uintptr_t fdt, const char *path, const struct fdt_cb *cb);
 uint32_t fdt_size(uintptr_t fdt);
 
 // Extract fields
@@ -54,16 +63,28 @@ const uint32_t *fdt_get_address(const struct fdt_scan_node *node, const uint32_t
 const uint32_t *fdt_get_size(const struct fdt_scan_node *node, const uint32_t *base, uint64_t *value);
 int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str); // -1 if not found
 
+// Add a node with the given properties at the end of the root node. The
+// blob grows in place, so there must be free memory after it.
+struct fdt_new_prop {
+  const char *name;
+  const void *value; // already in FDT (big-endian) byte order
+  int len;
+};
+void fdt_add_node(uintptr_t fdt, const char *name, const struct fdt_new_prop *props, int nprops);
+
 // Setup memory+clint+plic
 void query_mem(uintptr_t fdt);
 void query_harts(uintptr_t fdt);
 void query_plic(uintptr_t fdt);
 void query_clint(uintptr_t fdt);
+void query_timebase(uintptr_t fdt);
+void query_initrd(uintptr_t fdt);
 
 // Remove information from FDT
 void filter_harts(uintptr_t fdt, long *disabled_hart_mask);
 void filter_plic(uintptr_t fdt);
 void filter_compat(uintptr_t fdt, const char *compat);
+void filter_mem(uintptr_t fdt, uint64_t size); // shrink the bank we run from
 
 // The hartids of available harts
 extern uint64_t hart_mask;
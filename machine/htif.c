@@ -3,6 +3,7 @@
 #include "mtrap.h"
 #include "fdt.h"
 #include <string.h>
+#include <errno.h>
 
 extern uint64_t __htif_base;
 volatile uint64_t tohost __attribute__((section(".htif")));
@@ -11,6 +12,30 @@ volatile int htif_console_buf;
 static spinlock_t htif_lock = SPINLOCK_INIT;
 uintptr_t htif;
 
+// The host answers syscall-device requests in the order they were posted,
+// so a request is complete once the completion count has passed its sequence
+static uint64_t htif_syscall_posted;
+static volatile uint64_t htif_syscall_completed;
+
+struct request {
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t tag;
+};
+
+// Disk requests are posted without waiting. Each is tagged with its slot in
+// htif_disk_reqs, the host answers with that tag, and __check_fromhost
+// records the answer in htif_disk_done until the submitter reaps it.
+#define HTIF_DISK_ALL ((1U << HTIF_DISK_QUEUE) - 1)
+#define HTIF_DISK_ASYNC (HTIF_DISK_ALL >> 1) // tags htif_disk_submit may take
+static struct request htif_disk_reqs[HTIF_DISK_QUEUE];
+static uint32_t htif_disk_busy;
+static uint32_t htif_disk_sync; // waited on by htif_disk_wait, not polled
+static volatile uint32_t htif_disk_done;
+static int htif_disk_probed;
+struct htif_disk_info htif_disk;
+
 #define TOHOST(base_int)	(uint64_t *)(base_int + TOHOST_OFFSET)
 #define FROMHOST(base_int)	(uint64_t *)(base_int + FROMHOST_OFFSET)
 
@@ -24,6 +49,20 @@ static void __check_fromhost()
     return;
   fromhost = 0;
 
+  if (FROMHOST_DEV(fh) == 0) {
+    htif_syscall_completed++;
+    return;
+  }
+
+  if (FROMHOST_DEV(fh) == 2) {
+    if (FROMHOST_CMD(fh) == 255)
+      return; // an identify answered after htif_disk_probe gave up
+    uint64_t tag = FROMHOST_DATA(fh);
+    assert(tag < HTIF_DISK_QUEUE && (htif_disk_busy & (1U << tag)));
+    htif_disk_done |= 1U << tag;
+    return;
+  }
+
   // this should be from the console
   assert(FROMHOST_DEV(fh) == 1);
   switch (FROMHOST_CMD(fh)) {
@@ -58,27 +97,31 @@ int htif_console_getchar()
   return ch - 1;
 }
 
-static void do_tohost_fromhost(uintptr_t dev, uintptr_t cmd, uintptr_t data)
+uint64_t htif_syscall_post(uintptr_t arg)
 {
   spinlock_lock(&htif_lock);
-    __set_tohost(dev, cmd, data);
+    __set_tohost(0, 0, arg);
+    uint64_t seq = htif_syscall_posted++;
+  spinlock_unlock(&htif_lock);
+  return seq;
+}
 
-    while (1) {
-      uint64_t fh = fromhost;
-      if (fh) {
-        if (FROMHOST_DEV(fh) == dev && FROMHOST_CMD(fh) == cmd) {
-          fromhost = 0;
-          break;
-        }
-        __check_fromhost();
-      }
-    }
+int htif_syscall_poll(uint64_t seq)
+{
+  if (htif_syscall_completed > seq)
+    return 1;
+
+  spinlock_lock(&htif_lock);
+    __check_fromhost();
   spinlock_unlock(&htif_lock);
+  return htif_syscall_completed > seq;
 }
 
 void htif_syscall(uintptr_t arg)
 {
-  do_tohost_fromhost(0, 0, arg);
+  uint64_t seq = htif_syscall_post(arg);
+  while (!htif_syscall_poll(seq))
+    ;
 }
 
 void htif_console_putchar(uint8_t ch)
@@ -88,6 +131,27 @@ void htif_console_putchar(uint8_t ch)
   spinlock_unlock(&htif_lock);
 }
 
+// The console device takes a byte per handshake, so longer strings go out
+// as a single write(1, ...) on the syscall device instead
+#define HTIF_SYS_write 64
+
+void htif_console_write(const char* s, size_t n)
+{
+  if (n <= 1) {
+    if (n)
+      htif_console_putchar(*s);
+    return;
+  }
+
+  volatile uint64_t magic_mem[8] __attribute__((aligned(64)));
+  magic_mem[0] = HTIF_SYS_write;
+  magic_mem[1] = 1;
+  magic_mem[2] = (uintptr_t)s;
+  magic_mem[3] = n;
+  mb();
+  htif_syscall((uintptr_t)magic_mem);
+}
+
 void htif_poweroff()
 {
   while (1) {
@@ -96,59 +160,167 @@ void htif_poweroff()
   }
 }
 
-struct request {
-  uint64_t addr;
-  uint64_t offset;
-  uint64_t size;
-  uint64_t tag;
-};
-
-void htif_disk_read(uintptr_t addr, uintptr_t offset, size_t size)
+static int __htif_disk_submit(int write, uintptr_t addr, uintptr_t offset, size_t size, int sync)
 {
-  struct request req;
+  int tag = -EBUSY;
+
+  if (!htif_disk_size())
+    return -ENODEV;
 
-  req.addr = addr;
-  req.offset = offset;
-  req.size = size;
-  req.tag = 0;
+  uint32_t avail = sync ? HTIF_DISK_ALL : HTIF_DISK_ASYNC;
+
+  spinlock_lock(&htif_lock);
+    if (~htif_disk_busy & avail) {
+      tag = __builtin_ctz(~htif_disk_busy & avail);
+      htif_disk_busy |= 1U << tag;
+      if (sync)
+        htif_disk_sync |= 1U << tag;
+
+      struct request* req = &htif_disk_reqs[tag];
+      req->addr = addr;
+      req->offset = offset;
+      req->size = size;
+      req->tag = tag;
+      mb();
+      __set_tohost(2, write ? 1 : 0, (uintptr_t) req);
+    }
+  spinlock_unlock(&htif_lock);
 
-  do_tohost_fromhost(2, 0, (uintptr_t) &req);
+  return tag;
 }
 
-void htif_disk_write(uintptr_t addr, uintptr_t offset, size_t size)
+int htif_disk_submit(int write, uintptr_t addr, uintptr_t offset, size_t size)
 {
-  struct request req;
+  return __htif_disk_submit(write, addr, offset, size, 0);
+}
 
-  req.addr = addr;
-  req.offset = offset;
-  req.size = size;
-  req.tag = 0;
+uint32_t htif_disk_poll()
+{
+  spinlock_lock(&htif_lock);
+    __check_fromhost();
+    uint32_t done = htif_disk_done & ~htif_disk_sync;
+    htif_disk_done &= ~done;
+    htif_disk_busy &= ~done;
+  spinlock_unlock(&htif_lock);
 
-  do_tohost_fromhost(2, 1, (uintptr_t) &req);
+  return done;
 }
 
-unsigned long htif_disk_size(void)
+// Like htif_disk_submit, but the tag is left for htif_disk_wait rather
+// than reported by htif_disk_poll
+int htif_disk_start(int write, uintptr_t addr, uintptr_t offset, size_t size)
 {
-  char idbuf[128];
-  uintptr_t addr = (uintptr_t) idbuf;
-  unsigned long payload;
-  char *id = idbuf, *s;
+  return __htif_disk_submit(write, addr, offset, size, 1);
+}
 
-  // The buffer address needs to be aligned to 64 bytes
-  if (addr % 64 != 0) {
-    unsigned long inc = 64 - (addr % 64);
-    addr += inc;
-    id += inc;
+// Wait for a set of started requests without reaping anyone else's
+void htif_disk_wait(uint32_t tags)
+{
+  while (tags) {
+    spinlock_lock(&htif_lock);
+      __check_fromhost();
+      uint32_t done = htif_disk_done & tags;
+      htif_disk_done &= ~done;
+      htif_disk_busy &= ~done;
+      htif_disk_sync &= ~done;
+    spinlock_unlock(&htif_lock);
+    tags &= ~done;
   }
+}
 
-  payload = (addr << 8) | 0xff;
-  do_tohost_fromhost(2, 255, payload);
+// Blocking requests only wait on each other for the reserved tag, and those
+// are always reaped, so a busy queue just means trying again
+static int htif_disk_xfer(int write, uintptr_t addr, uintptr_t offset, size_t size)
+{
+  int tag;
+  while ((tag = htif_disk_start(write, addr, offset, size)) == -EBUSY)
+    ;
+  if (tag < 0)
+    return tag;
+  htif_disk_wait(1U << tag);
+  return 0;
+}
+
+int htif_disk_read(uintptr_t addr, uintptr_t offset, size_t size)
+{
+  return htif_disk_xfer(0, addr, offset, size);
+}
+
+int htif_disk_write(uintptr_t addr, uintptr_t offset, size_t size)
+{
+  return htif_disk_xfer(1, addr, offset, size);
+}
+
+static unsigned long disk_id_field(const char* id, const char* key, unsigned long dflt)
+{
+  const char* s = strstr(id, key);
+  return s ? atol(s + strlen(key)) : dflt;
+}
+
+// Ask the disk device for its identity string, the first time anyone wants
+// to know about the disk. fesvr answers identify for every device slot, with
+// an empty string if no disk is there; other hosts may never answer, so after
+// HTIF_DISK_PROBE_TIMEOUT cycles there is taken to be no disk. A late answer
+// still lands in id, which is why it isn't on the stack.
+void htif_disk_probe()
+{
+  static char id[128] __attribute__((aligned(64)));
+
+  if (!htif)
+    return;
+
+  spinlock_lock(&htif_lock);
+    if (!htif_disk_probed) {
+      id[0] = 0;
+      mb();
+      __set_tohost(2, 255, ((uintptr_t) id << 8) | 0xff);
+
+      for (uintptr_t start = read_csr(mcycle); ; ) {
+        uint64_t fh = fromhost;
+        if (fh && FROMHOST_DEV(fh) == 2 && FROMHOST_CMD(fh) == 255) {
+          fromhost = 0;
+          id[127] = 0;
+          htif_disk.size = disk_id_field(id, "size=", 0);
+          htif_disk.block_size = disk_id_field(id, "block_size=", HTIF_DISK_BLOCK_SIZE);
+          htif_disk.read_only = disk_id_field(id, "read_only=", 0);
+          htif_disk.queue_depth = HTIF_DISK_QUEUE - 1;
+          break;
+        }
+        if (fh)
+          __check_fromhost();
+        if (read_csr(mcycle) - start > HTIF_DISK_PROBE_TIMEOUT)
+          break;
+      }
+      htif_disk_probed = 1;
+    }
+  spinlock_unlock(&htif_lock);
+}
+
+unsigned long htif_disk_size(void)
+{
+  if (!htif_disk_probed)
+    htif_disk_probe();
+  return htif_disk.size;
+}
+
+// Describe the disk to the payload, so its driver needs no probing traps
+void htif_disk_publish(uintptr_t fdt)
+{
+  if (!htif_disk_size())
+    return;
 
-  s = strstr(id, "size=");
-  if (s == NULL)
-    return 0;
-  s += 5;
-  return atol(s);
+  static const char compat[] = "ucb,htif-disk0";
+  uint32_t size[2] = { __builtin_bswap32(htif_disk.size >> 32), __builtin_bswap32(htif_disk.size) };
+  uint32_t block_size = __builtin_bswap32(htif_disk.block_size);
+  uint32_t queue_depth = __builtin_bswap32(htif_disk.queue_depth);
+  struct fdt_new_prop props[] = {
+    { "compatible", compat, sizeof(compat) },
+    { "size", size, sizeof(size) },
+    { "block-size", &block_size, sizeof(block_size) },
+    { "queue-depth", &queue_depth, sizeof(queue_depth) },
+    { "read-only", NULL, 0 },
+  };
+  fdt_add_node(fdt, "htif-disk", props, htif_disk.read_only ? 5 : 4);
 }
 
 struct htif_scan
@@ -189,5 +361,5 @@ void query_htif(uintptr_t fdt)
   cb.done = htif_done;
   cb.extra = &scan;
 
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, "ucb,htif0", &cb);
 }
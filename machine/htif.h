@@ -19,11 +19,36 @@
 extern uintptr_t htif;
 void query_htif(uintptr_t dtb);
 void htif_console_putchar(uint8_t);
+void htif_console_write(const char* s, size_t n);
 int htif_console_getchar();
 void htif_poweroff() __attribute__((noreturn));
 void htif_syscall(uintptr_t);
-void htif_disk_read(uintptr_t addr, uintptr_t offset, size_t size);
-void htif_disk_write(uintptr_t addr, uintptr_t offset, size_t size);
+uint64_t htif_syscall_post(uintptr_t);
+int htif_syscall_poll(uint64_t seq);
+
+// Disk requests in flight at once; tags are 0 to HTIF_DISK_QUEUE-1, and
+// submission fails with -EBUSY once all are taken. The last tag is kept for
+// blocking requests, so queued ones can never lock them out.
+#define HTIF_DISK_QUEUE 16
+int htif_disk_submit(int write, uintptr_t addr, uintptr_t offset, size_t size);
+uint32_t htif_disk_poll();
+int htif_disk_start(int write, uintptr_t addr, uintptr_t offset, size_t size);
+void htif_disk_wait(uint32_t tags);
+int htif_disk_read(uintptr_t addr, uintptr_t offset, size_t size);
+int htif_disk_write(uintptr_t addr, uintptr_t offset, size_t size);
+
+// The host's disk, identified on first use; size is 0 if there is none
+#define HTIF_DISK_BLOCK_SIZE 512 // unless the host says otherwise
+#define HTIF_DISK_PROBE_TIMEOUT (1UL << 28) // cycles to wait for identify
+struct htif_disk_info {
+  uint64_t size;
+  uint32_t block_size;
+  uint32_t read_only;
+  uint32_t queue_depth;
+};
+extern struct htif_disk_info htif_disk;
+void htif_disk_probe();
+void htif_disk_publish(uintptr_t fdt);
 unsigned long htif_disk_size(void);
 
 #endif
@@ -13,5 +13,12 @@
 #define SBI_DISK_READ 9
 #define SBI_DISK_WRITE 10
 #define SBI_DISK_SIZE 11
+// SUBMIT(addr, offset, size, write) returns a tag, or -EBUSY if the queue is
+// full. POLL returns a mask of tags completed since the last poll.
+#define SBI_DISK_SUBMIT 12
+#define SBI_DISK_POLL 13
+// EMULATION_PROFILE(reset) prints the emulation profile, then clears it if
+// reset is nonzero. -ENOSYS unless built with --enable-emulation-profile.
+#define SBI_EMULATION_PROFILE 14
 
 #endif
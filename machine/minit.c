@@ -7,11 +7,14 @@
 #include "finisher.h"
 #include "disabled_hart_mask.h"
 #include "htif.h"
+#include "disk_cache.h"
 #include <string.h>
 #include <limits.h>
 
 pte_t* root_page_table;
 uintptr_t mem_size;
+uint64_t timebase_freq;
+uintptr_t initrd_start, initrd_end;
 volatile uint64_t* mtime;
 volatile uint32_t* plic_priorities;
 size_t plic_ndevs;
@@ -77,14 +80,18 @@ static void fp_init()
 
 hls_t* hls_init(uintptr_t id)
 {
+  _Static_assert(sizeof(hls_t) <= HLS_SIZE, "hls_t doesn't fit in HLS_SIZE");
   hls_t* hls = OTHER_HLS(id);
   memset(hls, 0, sizeof(*hls));
   return hls;
 }
 
-static void memory_init()
+static void memory_init(uintptr_t dtb)
 {
   mem_size = mem_size / MEGAPAGE_SIZE * MEGAPAGE_SIZE;
+#ifdef PK_ENABLE_DISK_CACHE
+  mem_size = disk_cache_init(mem_size, dtb);
+#endif
 }
 
 static void hart_init()
@@ -151,6 +158,8 @@ void init_first_hart(uintptr_t hartid, uintptr_t dtb)
 
   query_mem(dtb);
   query_harts(dtb);
+  query_timebase(dtb);
+  query_initrd(dtb);
   query_clint(dtb);
   query_plic(dtb);
 
@@ -159,7 +168,7 @@ void init_first_hart(uintptr_t hartid, uintptr_t dtb)
   plic_init();
   hart_plic_init();
   //prci_test();
-  memory_init();
+  memory_init(dtb);
   boot_loader(dtb);
 }
 
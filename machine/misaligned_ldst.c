@@ -11,6 +11,49 @@ union byte_array {
   uint64_t int64;
 };
 
+// Read len <= sizeof(uintptr_t) bytes at addr using at most two aligned
+// loads, shifted and merged. Bytes are read one at a time only when the
+// access straddles a page, so that a fault reports the right address.
+static uintptr_t load_misaligned(uintptr_t addr, int len, uintptr_t mepc)
+{
+  const uintptr_t word = sizeof(uintptr_t);
+  uintptr_t base = addr & -word, off = addr & (word - 1);
+  uintptr_t val = 0;
+
+  if ((addr & (RISCV_PGSIZE - 1)) + len > RISCV_PGSIZE) {
+    for (int i = len - 1; i >= 0; i--)
+      val = (val << 8) | load_uint8_t((void *)(addr + i), mepc);
+    return val;
+  }
+
+  val = load_uintptr_t((uintptr_t *)base, mepc) >> (8 * off);
+  if (off + len > word)
+    val |= load_uintptr_t((uintptr_t *)(base + word), mepc) << (8 * (word - off));
+  if (len < word)
+    val &= ((uintptr_t)1 << (8 * len)) - 1;
+  return val;
+}
+
+// Write len bytes at addr as the fewest naturally aligned stores (addr is
+// misaligned, so no piece is wider than 4). Nothing outside
+// [addr, addr+len) is written, so neighbouring data is never read back and
+// clobbered.
+static void store_misaligned(uintptr_t addr, uint64_t val, int len, uintptr_t mepc)
+{
+  while (len > 0) {
+    if ((addr & 3) == 0 && len >= 4) {
+      store_uint32_t((uint32_t *)addr, val, mepc);
+      addr += 4, len -= 4, val >>= 32;
+    } else if ((addr & 1) == 0 && len >= 2) {
+      store_uint16_t((uint16_t *)addr, val, mepc);
+      addr += 2, len -= 2, val >>= 16;
+    } else {
+      store_uint8_t((uint8_t *)addr, val, mepc);
+      addr += 1, len -= 1, val >>= 8;
+    }
+  }
+}
+
 void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   union byte_array val;
@@ -65,9 +108,13 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   else
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
-  val.int64 = 0;
-  for (intptr_t i = 0; i < len; i++)
-    val.bytes[i] = load_uint8_t((void *)(addr + i), mepc);
+  if (len <= sizeof(uintptr_t)) {
+    val.int64 = 0;
+    val.intx = load_misaligned(addr, len, mepc);
+  } else {
+    val.int64 = load_misaligned(addr, 4, mepc) |
+                (uint64_t)load_misaligned(addr + 4, 4, mepc) << 32;
+  }
 
   if (!fp)
     SET_RD(insn, regs, (intptr_t)val.intx << shift >> shift);
@@ -77,6 +124,7 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
     SET_F32_RD(insn, regs, val.intx);
 
   write_csr(mepc, npc);
+  emulate_following(regs, mepc);
 }
 
 void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
@@ -130,8 +178,8 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
   uintptr_t addr = read_csr(mbadaddr);
-  for (int i = 0; i < len; i++)
-    store_uint8_t((void *)(addr + i), val.bytes[i], mepc);
+  store_misaligned(addr, val.int64, len, mepc);
 
   write_csr(mepc, npc);
+  emulate_following(regs, mepc);
 }
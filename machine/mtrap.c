@@ -1,6 +1,9 @@
 #include "mtrap.h"
 #include "mcall.h"
 #include "htif.h"
+#include "disk_cache.h"
+#include "emulation.h"
+#include "emulation_profile.h"
 #include "atomic.h"
 #include "bits.h"
 #include "vm.h"
@@ -12,6 +15,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 void __attribute__((noreturn)) bad_trap(uintptr_t* regs, uintptr_t dummy, uintptr_t mepc)
 {
@@ -30,6 +34,7 @@ static uintptr_t mcall_console_putchar(uint8_t ch)
 
 void poweroff(uint16_t code)
 {
+  emulation_profile_print();
   printm("Power off\n");
   finisher_exit(code);
   if (htif) {
@@ -41,8 +46,12 @@ void poweroff(uint16_t code)
 
 void putstring(const char* s)
 {
-  while (*s)
-    mcall_console_putchar(*s++);
+  size_t n = strlen(s);
+  if (uart) {
+    uart_write(s, n);
+  } else if (htif) {
+    htif_console_write(s, n);
+  }
 }
 
 void vprintm(const char* s, va_list vl)
@@ -100,14 +109,35 @@ static uintptr_t mcall_set_timer(uint64_t when)
 
 static uintptr_t mcall_disk_read(uintptr_t addr, uintptr_t offset, size_t size)
 {
-  htif_disk_read(addr, offset, size);
-  return 0;
+#ifdef PK_ENABLE_DISK_CACHE
+  return disk_cache_read(addr, offset, size);
+#else
+  return htif_disk_read(addr, offset, size);
+#endif
 }
 
 static uintptr_t mcall_disk_write(uintptr_t addr, uintptr_t offset, size_t size)
 {
-  htif_disk_write(addr, offset, size);
-  return 0;
+#ifdef PK_ENABLE_DISK_CACHE
+  return disk_cache_write(addr, offset, size);
+#else
+  return htif_disk_write(addr, offset, size);
+#endif
+}
+
+static uintptr_t mcall_disk_submit(uintptr_t addr, uintptr_t offset, size_t size, int write)
+{
+#ifdef PK_ENABLE_DISK_CACHE
+  // Queued reads go around the cache, so queued writes must keep it current
+  if (write)
+    disk_cache_update(addr, offset, size);
+#endif
+  return htif_disk_submit(write, addr, offset, size);
+}
+
+static uintptr_t mcall_disk_poll(void)
+{
+  return htif_disk_poll();
 }
 
 static uintptr_t mcall_disk_size(void)
@@ -115,13 +145,86 @@ static uintptr_t mcall_disk_size(void)
   return htif_disk_size();
 }
 
-static void send_ipi_many(uintptr_t* pmask, int event)
+static uintptr_t mcall_emulation_profile(uintptr_t reset)
+{
+#ifdef PK_ENABLE_EMULATION_PROFILE
+  emulation_profile_print();
+  if (reset)
+    emulation_profile_reset();
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+// Fences of more pages than this flush the whole TLB instead
+#define SFENCE_MAX_PAGES 64
+#define SFENCE_ALL_ASIDS ((uintptr_t)-1)
+
+static void sfence_range(uintptr_t start, uintptr_t size, uintptr_t asid)
+{
+  uintptr_t end = start + size;
+
+  // Linux passes size -1 for everything
+  if (size == 0 || size > SFENCE_MAX_PAGES * RISCV_PGSIZE || end < start) {
+    if (asid == SFENCE_ALL_ASIDS)
+      flush_tlb();
+    else
+      flush_tlb_asid(asid);
+    return;
+  }
+
+  for (uintptr_t va = start & -RISCV_PGSIZE; va < end; va += RISCV_PGSIZE) {
+    if (asid == SFENCE_ALL_ASIDS)
+      flush_tlb_page(va);
+    else
+      flush_tlb_page_asid(va, asid);
+  }
+}
+
+// Do the fences other harts are waiting on this one for
+static void serve_remote_sfences()
+{
+  uintptr_t from = atomic_swap(&HLS()->sfence_from, 0);
+  if (!from)
+    return;
+  mb();
+
+  uintptr_t self = 1UL << read_const_csr(mhartid);
+  for (uintptr_t i = 0; from; i++, from >>= 1) {
+    if (from & 1) {
+      hls_t* sender = OTHER_HLS(i);
+      sfence_range(sender->sfence_start, sender->sfence_size, sender->sfence_asid);
+      atomic_and(&sender->sfence_waiting, ~self);
+    }
+  }
+}
+
+void sfence_ipi_trap(uintptr_t* regs, uintptr_t dummy, uintptr_t mepc)
+{
+  serve_remote_sfences();
+}
+
+// While waiting on other harts, keep their requests of this one from
+// deadlocking against ours: take our IPIs off the wire for later, and do
+// the fences asked of us now.
+static uint32_t hold_incoming_ipis()
+{
+  serve_remote_sfences();
+  return atomic_swap(HLS()->ipi, 0);
+}
+
+static uintptr_t ipi_targets(uintptr_t* pmask)
 {
   _Static_assert(MAX_HARTS <= 8 * sizeof(*pmask), "# harts > uintptr_t bits");
-  uintptr_t mask = hart_mask;
+  uintptr_t mask = hart_mask & ~disabled_hart_mask;
   if (pmask)
     mask &= load_uintptr_t(pmask, read_csr(mepc));
+  return mask;
+}
 
+static void send_ipi_many(uintptr_t mask, int event)
+{
   // send IPIs to everyone
   for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
     if (m & 1)
@@ -130,13 +233,18 @@ static void send_ipi_many(uintptr_t* pmask, int event)
   if (event == IPI_SOFT)
     return;
 
-  // wait until all events have been handled.
-  // prevent deadlock by consuming incoming IPIs.
+  // wait until all events have been handled: remote sfences report back
+  // through sfence_waiting, the rest by clearing the recipient's MSIP.
   uint32_t incoming_ipi = 0;
-  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
-    if (m & 1)
-      while (*OTHER_HLS(i)->ipi)
-        incoming_ipi |= atomic_swap(HLS()->ipi, 0);
+  if (event == IPI_SFENCE_VMA) {
+    while (atomic_read(&HLS()->sfence_waiting))
+      incoming_ipi |= hold_incoming_ipis();
+  } else {
+    for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
+      if (m & 1)
+        while (*OTHER_HLS(i)->ipi)
+          incoming_ipi |= hold_incoming_ipis();
+  }
 
   // if we got an IPI, restore it; it will be taken after returning
   if (incoming_ipi) {
@@ -145,6 +253,34 @@ static void send_ipi_many(uintptr_t* pmask, int event)
   }
 }
 
+static uintptr_t mcall_remote_sfence_vma(uintptr_t* pmask, uintptr_t start, uintptr_t size, uintptr_t asid)
+{
+  uintptr_t mask = ipi_targets(pmask);
+  uintptr_t self = 1UL << read_const_csr(mhartid);
+
+  if (mask & self) {
+    sfence_range(start, size, asid);
+    mask &= ~self;
+  }
+  if (!mask)
+    return 0;
+
+  // Recipients read the range from our HLS, which stays put until the last
+  // of them is done with it
+  hls_t* hls = HLS();
+  hls->sfence_start = start;
+  hls->sfence_size = size;
+  hls->sfence_asid = asid;
+  hls->sfence_waiting = mask;
+  mb();
+
+  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
+    if (m & 1)
+      atomic_or(&OTHER_HLS(i)->sfence_from, self);
+  send_ipi_many(mask, IPI_SFENCE_VMA);
+  return 0;
+}
+
 void mcall_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   write_csr(mepc, mepc + 4);
@@ -164,13 +300,16 @@ void mcall_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
       ipi_type = IPI_SOFT;
       goto send_ipi;
     case SBI_REMOTE_SFENCE_VMA:
+      retval = mcall_remote_sfence_vma((uintptr_t*)arg0, arg1, arg2, SFENCE_ALL_ASIDS);
+      break;
     case SBI_REMOTE_SFENCE_VMA_ASID:
-      ipi_type = IPI_SFENCE_VMA;
-      goto send_ipi;
+      retval = mcall_remote_sfence_vma((uintptr_t*)arg0, arg1, arg2, regs[13]);
+      break;
     case SBI_REMOTE_FENCE_I:
+      decode_cache_flush();
       ipi_type = IPI_FENCE_I;
 send_ipi:
-      send_ipi_many((uintptr_t*)arg0, ipi_type);
+      send_ipi_many(ipi_targets((uintptr_t*)arg0), ipi_type);
       retval = 0;
       break;
     case SBI_CLEAR_IPI:
@@ -195,6 +334,15 @@ send_ipi:
     case SBI_DISK_SIZE:
       retval = mcall_disk_size();
       break;
+    case SBI_DISK_SUBMIT:
+      retval = mcall_disk_submit(arg0, arg1, arg2, regs[13]);
+      break;
+    case SBI_DISK_POLL:
+      retval = mcall_disk_poll();
+      break;
+    case SBI_EMULATION_PROFILE:
+      retval = mcall_emulation_profile(arg0);
+      break;
     default:
       retval = -ENOSYS;
       break;
@@ -216,6 +364,7 @@ void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr)
   new_mstatus |= mpp_s;
   write_csr(mstatus, new_mstatus);
 
+  emulate_following_cancel();
   extern void __redirect_trap();
   return __redirect_trap();
 }
@@ -30,6 +30,8 @@ static inline int xlen()
 }
 
 extern uintptr_t mem_size;
+extern uint64_t timebase_freq;
+extern uintptr_t initrd_start, initrd_end;
 extern volatile uint64_t* mtime;
 extern volatile uint32_t* plic_priorities;
 extern size_t plic_ndevs;
@@ -44,6 +46,15 @@ typedef struct {
   volatile uintptr_t* plic_m_ie;
   volatile uint32_t* plic_s_thresh;
   volatile uintptr_t* plic_s_ie;
+
+  // A remote sfence.vma: the range this hart asks for while it waits in
+  // send_ipi_many, the recipients yet to fence it, and the harts whose
+  // ranges this hart is yet to fence
+  uintptr_t sfence_start;
+  uintptr_t sfence_size;
+  uintptr_t sfence_asid;
+  volatile uintptr_t sfence_waiting;
+  volatile uintptr_t sfence_from;
 } hls_t;
 
 #define MACHINE_STACK_TOP() ({ \
@@ -75,6 +86,9 @@ static inline void wfi()
 
 #endif // !__ASSEMBLER__
 
+// rdtime ticks per second if the device tree does not say (Spike's rate)
+#define DEFAULT_TIMEBASE_FREQ 10000000
+
 #define IPI_SOFT       0x1
 #define IPI_FENCE_I    0x2
 #define IPI_SFENCE_VMA 0x4
@@ -90,7 +104,7 @@ static inline void wfi()
 #else
 # define SOFT_FLOAT_CONTEXT_SIZE (8 * 32)
 #endif
-#define HLS_SIZE 64
+#define HLS_SIZE 128
 #define INTEGER_CONTEXT_SIZE (32 * REGBYTES)
 
 #endif
@@ -21,6 +21,14 @@ void uart_putchar(uint8_t ch)
 #endif
 }
 
+// Each byte is one MMIO store unless the TX FIFO is full, so a string is
+// already a burst; there is no per-byte handshake to batch
+void uart_write(const char* s, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    uart_putchar(s[i]);
+}
+
 int uart_getchar()
 {
   int32_t ch = uart[UART_REG_RXFIFO];
@@ -72,5 +80,5 @@ void query_uart(uintptr_t fdt)
   cb.done = uart_done;
   cb.extra = &scan;
 
-  fdt_scan(fdt, &cb);
+  fdt_scan_compatible(fdt, "sifive,uart0", &cb);
 }
@@ -2,6 +2,7 @@
 #define _RISCV_UART_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 extern volatile uint32_t* uart;
 
@@ -15,6 +16,7 @@ extern volatile uint32_t* uart;
 #define UART_RXEN		 0x1
 
 void uart_putchar(uint8_t ch);
+void uart_write(const char* s, size_t n);
 int uart_getchar();
 void query_uart(uintptr_t dtb);
 
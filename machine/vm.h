@@ -7,10 +7,12 @@
 #define MEGAPAGE_SIZE ((uintptr_t)(RISCV_PGSIZE << RISCV_PGLEVEL_BITS))
 #if __riscv_xlen == 64
 # define SATP_MODE_CHOICE INSERT_FIELD(0, SATP64_MODE, SATP_MODE_SV39)
+# define SATP_ASID SATP64_ASID
 # define VA_BITS 39
 # define GIGAPAGE_SIZE (MEGAPAGE_SIZE << RISCV_PGLEVEL_BITS)
 #else
 # define SATP_MODE_CHOICE INSERT_FIELD(0, SATP32_MODE, SATP_MODE_SV32)
+# define SATP_ASID SATP32_ASID
 # define VA_BITS 32
 #endif
 
@@ -22,6 +24,21 @@ static inline void flush_tlb()
   asm volatile ("sfence.vma");
 }
 
+static inline void flush_tlb_page(uintptr_t va)
+{
+  asm volatile ("sfence.vma %0" : : "r" (va) : "memory");
+}
+
+static inline void flush_tlb_asid(uintptr_t asid)
+{
+  asm volatile ("sfence.vma x0, %0" : : "r" (asid) : "memory");
+}
+
+static inline void flush_tlb_page_asid(uintptr_t va, uintptr_t asid)
+{
+  asm volatile ("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
 static inline pte_t pte_create(uintptr_t ppn, int type)
 {
   return (ppn << PTE_PPN_SHIFT) | PTE_V | type;
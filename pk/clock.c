@@ -0,0 +1,44 @@
+// See LICENSE for license details.
+
+#include "clock.h"
+#include "boot.h"
+#include "mtrap.h"
+#include "pk.h"
+
+static uint64_t boot_time;
+static uint64_t realtime0_ns; // CLOCK_REALTIME at boot; 0 as there is no RTC
+
+void clock_init()
+{
+  boot_time = rdtime();
+}
+
+uint64_t clock_ns(uint64_t ticks)
+{
+  return ticks / timebase_freq * 1000000000ULL +
+         ticks % timebase_freq * 1000000000ULL / timebase_freq;
+}
+
+int clock_get_ns(int clk, uint64_t* ns)
+{
+  switch (clk)
+  {
+    case PK_CLOCK_REALTIME:
+    case PK_CLOCK_REALTIME_COARSE:
+      *ns = realtime0_ns + clock_ns(rdtime() - boot_time);
+      return 0;
+    case PK_CLOCK_MONOTONIC:
+    case PK_CLOCK_MONOTONIC_RAW:
+    case PK_CLOCK_MONOTONIC_COARSE:
+    case PK_CLOCK_BOOTTIME:
+      *ns = clock_ns(rdtime() - boot_time);
+      return 0;
+    case PK_CLOCK_PROCESS_CPUTIME_ID:
+    case PK_CLOCK_THREAD_CPUTIME_ID:
+      // pk runs a single process that owns the hart from start to exit
+      *ns = clock_ns(rdtime() - current.time0);
+      return 0;
+    default:
+      return -1;
+  }
+}
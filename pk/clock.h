@@ -0,0 +1,21 @@
+// See LICENSE for license details.
+
+#ifndef _PK_CLOCK_H
+#define _PK_CLOCK_H
+
+#include <stdint.h>
+
+#define PK_CLOCK_REALTIME           0
+#define PK_CLOCK_MONOTONIC          1
+#define PK_CLOCK_PROCESS_CPUTIME_ID 2
+#define PK_CLOCK_THREAD_CPUTIME_ID  3
+#define PK_CLOCK_MONOTONIC_RAW      4
+#define PK_CLOCK_REALTIME_COARSE    5
+#define PK_CLOCK_MONOTONIC_COARSE   6
+#define PK_CLOCK_BOOTTIME           7
+
+void clock_init();
+uint64_t clock_ns(uint64_t ticks);
+int clock_get_ns(int clk, uint64_t* ns);
+
+#endif
@@ -41,11 +41,14 @@ void dump_tf(trapframe_t* tf)
          (uint32_t)tf->insn, tf->status);
 }
 
+volatile int panicking;
+
 void do_panic(const char* s, ...)
 {
   va_list vl;
   va_start(vl, s);
 
+  panicking = 1;
   vprintk(s, vl);
   shutdown(-1);
 
@@ -6,13 +6,113 @@
 #include "frontend.h"
 #include "syscall.h"
 #include "pk.h"
+#include "bits.h"
 #include <string.h>
 #include <errno.h>
 
-#define MAX_FDS 128
-static file_t* fds[MAX_FDS];
-#define MAX_FILES 128
-file_t files[MAX_FILES] = {[0 ... MAX_FILES-1] = {-1,0}};
+// The file and descriptor tables grow a page-sized chunk at a time, as many
+// entries as fit. Each chunk has a bitmap of taken slots, so a free slot is
+// found with one ctz per word and descriptors are handed out lowest-first.
+// Chunk 0 of each table is static so that the console files exist before VM
+// is up.
+#define BITS_PER_WORD (8 * sizeof(uintptr_t))
+#define MAX_CHUNKS 256
+#define FILE_CHUNK (RISCV_PGSIZE / sizeof(file_t))
+#define FILE_WORDS (ROUNDUP(FILE_CHUNK, BITS_PER_WORD) / BITS_PER_WORD)
+#define FD_CHUNK (RISCV_PGSIZE / sizeof(file_t*))
+#define FD_WORDS (FD_CHUNK / BITS_PER_WORD)
+
+file_t files[FILE_CHUNK] = {[0 ... FILE_CHUNK-1] = {-1,0}};
+static file_t* file_chunks[MAX_CHUNKS] = {files};
+static uintptr_t file_used[MAX_CHUNKS][FILE_WORDS];
+
+static file_t* fds0[FD_CHUNK];
+static file_t** fd_chunks[MAX_CHUNKS] = {fds0};
+static uintptr_t fd_used[MAX_CHUNKS][FD_WORDS];
+
+static spinlock_t table_lock = SPINLOCK_INIT;
+static file_wbuf_t console_wbuf[2];
+
+// Read cache for regular files. Blocks are keyed by (kfd, offset) and are
+// dropped when their descriptor is closed. Another descriptor may name the
+// same file, so a write or truncate through any of them drops every block.
+// pos, pos_ahead and ra_next of cached files are also protected by
+// file_cache_lock.
+#define FILE_CACHE_BLOCKS 8
+#define FILE_CACHE_BLOCK_SIZE RISCV_PGSIZE
+#define FILE_CACHE_ALL -1 // file_cache_inval: drop the blocks of every kfd
+typedef struct {
+  int kfd;       // -1 if free
+  off_t off;
+  ssize_t len;   // valid bytes; short at end of file
+  long tag;      // outstanding read-ahead, or -1
+  uint64_t used; // LRU stamp
+} file_cache_block_t;
+
+static file_cache_block_t file_cache[FILE_CACHE_BLOCKS] =
+  {[0 ... FILE_CACHE_BLOCKS-1] = {.kfd = -1, .tag = -1}};
+static char file_cache_data[FILE_CACHE_BLOCKS][FILE_CACHE_BLOCK_SIZE]
+  __attribute__((aligned(RISCV_PGSIZE)));
+static spinlock_t file_cache_lock = SPINLOCK_INIT;
+static uint64_t file_cache_clock;
+static int file_cache_inflight;
+
+static void file_cache_inval(int kfd);
+
+// Claim the lowest clear bit of the first nbits in words; returns its index
+// or -1
+static long bitmap_claim(uintptr_t* words, size_t nbits)
+{
+  for (size_t i = 0; i * BITS_PER_WORD < nbits; i++)
+  {
+    uintptr_t w;
+    while (~(w = atomic_read(&words[i])))
+    {
+      size_t idx = i * BITS_PER_WORD + __builtin_ctzl(~w);
+      if (idx >= nbits)
+        return -1;
+      if (atomic_cas(&words[i], w, w | (1UL << (idx % BITS_PER_WORD))) == w)
+        return idx;
+    }
+  }
+  return -1;
+}
+
+static void bitmap_release(uintptr_t* words, size_t idx)
+{
+  atomic_and(&words[idx / BITS_PER_WORD], ~(1UL << (idx % BITS_PER_WORD)));
+}
+
+// Returns chunk c, allocating it if need be, or NULL if no page is left
+static void* table_chunk(void** chunks, size_t c)
+{
+  void* chunk = atomic_read(&chunks[c]);
+  if (!chunk)
+  {
+    spinlock_lock(&table_lock);
+      if (!(chunk = chunks[c]) && (chunk = (void*)page_try_alloc()))
+      {
+        mb();
+        chunks[c] = chunk;
+      }
+    spinlock_unlock(&table_lock);
+  }
+  return chunk;
+}
+
+static void file_release(file_t* f)
+{
+  for (size_t c = 0; c < MAX_CHUNKS; c++)
+  {
+    file_t* chunk = atomic_read(&file_chunks[c]);
+    if (chunk && f >= chunk && f < chunk + FILE_CHUNK)
+    {
+      bitmap_release(file_used[c], f - chunk);
+      return;
+    }
+  }
+  kassert(0);
+}
 
 void file_incref(file_t* f)
 {
@@ -24,33 +124,63 @@ void file_decref(file_t* f)
 {
   if (atomic_add(&f->refcnt, -1) == 2)
   {
+    file_sync(f);
+    f->wbuf = NULL;
+    if (f->cached)
+      file_cache_inval(f->kfd);
+
     int kfd = f->kfd;
+    int ram = f->ram.data != NULL;
+    f->ram.data = NULL;
     mb();
     atomic_set(&f->refcnt, 0);
 
-    frontend_syscall(SYS_close, kfd, 0, 0, 0, 0, 0, 0);
+    if (!ram)
+      frontend_syscall(SYS_close, kfd, 0, 0, 0, 0, 0, 0);
+    file_release(f);
   }
 }
 
 static file_t* file_get_free()
 {
-  for (file_t* f = files; f < files + MAX_FILES; f++)
-    if (atomic_read(&f->refcnt) == 0 && atomic_cas(&f->refcnt, 0, 2) == 0)
+  for (size_t c = 0; c < MAX_CHUNKS; c++)
+  {
+    long i = bitmap_claim(file_used[c], FILE_CHUNK);
+    if (i >= 0)
+    {
+      file_t* chunk = table_chunk((void**)file_chunks, c);
+      if (!chunk)
+      {
+        bitmap_release(file_used[c], i);
+        return NULL;
+      }
+      file_t* f = chunk + i;
+      atomic_set(&f->refcnt, 2);
       return f;
+    }
+  }
   return NULL;
 }
 
 int file_dup(file_t* f)
 {
-  for (int i = 0; i < MAX_FDS; i++)
+  for (size_t c = 0; c < MAX_CHUNKS; c++)
   {
-    if (atomic_cas(&fds[i], 0, f) == 0)
+    long i = bitmap_claim(fd_used[c], FD_CHUNK);
+    if (i >= 0)
     {
+      file_t** chunk = table_chunk((void**)fd_chunks, c);
+      if (!chunk)
+      {
+        bitmap_release(fd_used[c], i);
+        return -EMFILE;
+      }
       file_incref(f);
-      return i;
+      atomic_set(&chunk[i], f);
+      return c * FD_CHUNK + i;
     }
   }
-  return -1;
+  return -EMFILE;
 }
 
 void file_init()
@@ -61,12 +191,19 @@ void file_init()
     f->kfd = i;
     file_dup(f);
   }
+
+  // stdout and stderr are line buffered
+  stdout->wbuf = &console_wbuf[0];
+  stderr->wbuf = &console_wbuf[1];
 }
 
 file_t* file_get(int fd)
 {
+  file_t** chunk;
   file_t* f;
-  if (fd < 0 || fd >= MAX_FDS || (f = atomic_read(&fds[fd])) == NULL)
+  if (fd < 0 || fd >= MAX_CHUNKS * FD_CHUNK ||
+      (chunk = atomic_read(&fd_chunks[fd / FD_CHUNK])) == NULL ||
+      (f = atomic_read(&chunk[fd % FD_CHUNK])) == NULL)
     return 0;
 
   long old_cnt;
@@ -84,17 +221,51 @@ file_t* file_open(const char* fn, int flags, int mode)
   return file_openat(AT_FDCWD, fn, flags, mode);
 }
 
+// initrd files never reach the host; they are read-only
+static file_t* file_open_ram(const char* fn, int flags)
+{
+  ramfs_node_t node;
+  long ret = ramfs_lookup(fn, &node);
+  if (ret < 0)
+    return ERR_PTR(flags & PK_O_CREAT ? -EROFS : ret);
+  if ((flags & PK_O_ACCMODE) != 0)
+    return ERR_PTR(-EROFS);
+
+  file_t* f = file_get_free();
+  if (f == NULL)
+    return ERR_PTR(-ENFILE);
+
+  f->kfd = -1;
+  f->wbuf = NULL;
+  f->cached = 0;
+  f->pos_ahead = 0;
+  f->pos = 0;
+  f->ra_next = 0;
+  f->ram = node;
+  return f;
+}
+
 file_t* file_openat(int dirfd, const char* fn, int flags, int mode)
 {
+  if (ramfs_owns(fn))
+    return file_open_ram(fn, flags);
+
   file_t* f = file_get_free();
   if (f == NULL)
-    return ERR_PTR(-ENOMEM);
+    return ERR_PTR(-ENFILE);
 
+  f->ram.data = NULL;
   size_t fn_size = strlen(fn)+1;
   long ret = frontend_syscall(SYS_openat, dirfd, va2pa(fn), fn_size, flags, mode, 0, 0);
   if (ret >= 0)
   {
+    struct frontend_stat st;
     f->kfd = ret;
+    f->cached = frontend_syscall(SYS_fstat, ret, va2pa(&st), 0, 0, 0, 0, 0) == 0 &&
+                S_ISREG(st.mode);
+    f->pos_ahead = 0;
+    f->pos = 0;
+    f->ra_next = 0;
     return f;
   }
   else
@@ -109,40 +280,487 @@ int fd_close(int fd)
   file_t* f = file_get(fd);
   if (!f)
     return -1;
-  file_t* old = atomic_cas(&fds[fd], f, 0);
+  file_t* old = atomic_cas(&fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK], f, 0);
   file_decref(f);
   if (old != f)
     return -1;
+  bitmap_release(fd_used[fd / FD_CHUNK], fd % FD_CHUNK);
   file_decref(f);
   return 0;
 }
 
+// Send a batch of physical extents to the host: as one vectored request if
+// the host supports it, else one request per extent. Stops at the first
+// short transfer, like a single read/write would.
+static ssize_t file_xfer_extents(file_t* f, long n, long nv,
+                                 struct frontend_iov* iov, size_t cnt, off_t offset)
+{
+#ifdef PK_ENABLE_HTIF_IOV
+  if (cnt > 1)
+    return frontend_syscall(nv, f->kfd, va2pa(iov), cnt, offset, 0, 0, 0);
+#endif
+
+  ssize_t r = 0;
+  for (size_t i = 0; i < cnt; i++)
+  {
+    ssize_t ri = frontend_syscall(n, f->kfd, iov[i].base, iov[i].len,
+                                  offset + r, 0, 0, 0);
+    if (ri < 0)
+      return r ? r : ri;
+    r += ri;
+    if ((size_t)ri < iov[i].len)
+      break;
+  }
+  return r;
+}
+
+// Transfer a list of (base, len) buffers, split into physical extents and
+// sent FRONTEND_IOV_MAX extents at a time
+static ssize_t file_xferv(file_t* f, long n, long nv, const long* uiov, int ucnt,
+                          off_t offset)
+{
+  struct frontend_iov iov[FRONTEND_IOV_MAX];
+  size_t done = 0, skip = 0;
+  int i = 0;
+
+  while (i < ucnt)
+  {
+    size_t cnt = 0, len = 0;
+    while (i < ucnt && cnt < FRONTEND_IOV_MAX)
+    {
+      size_t covered;
+      cnt += frontend_iov_build(iov + cnt, FRONTEND_IOV_MAX - cnt,
+                                (const char*)uiov[2*i] + skip, uiov[2*i+1] - skip,
+                                &covered);
+      len += covered;
+      skip += covered;
+      if (skip < (size_t)uiov[2*i+1])
+        break;
+      i++;
+      skip = 0;
+    }
+
+    if (cnt == 0)
+      continue;
+
+    ssize_t r = file_xfer_extents(f, n, nv, iov, cnt, offset + done);
+    if (r < 0)
+      return done ? (ssize_t)done : r;
+    done += r;
+    if ((size_t)r < len)
+      break;
+  }
+
+  return done;
+}
+
+static ssize_t file_xfer(file_t* f, long n, long nv, const void* buf,
+                         size_t size, off_t offset)
+{
+  long uiov[2] = {(long)buf, size};
+  return file_xferv(f, n, nv, uiov, 1, offset);
+}
+
+// Caller holds b->lock. Whatever the host did not take stays buffered.
+static int __file_wbuf_flush(file_t* f, file_wbuf_t* b)
+{
+  size_t done = 0;
+  long r = 0;
+
+  while (done < b->len)
+  {
+    r = frontend_syscall(SYS_write, f->kfd, va2pa(b->data + done), b->len - done, 0, 0, 0, 0);
+    if (r <= 0)
+      break;
+    done += r;
+  }
+
+  b->len -= done;
+  memmove(b->data, b->data + done, b->len);
+  if (b->len == 0)
+    return 0;
+  return r < 0 ? r : -EIO;
+}
+
+static ssize_t file_write_buffered(file_t* f, const void* buf, size_t size)
+{
+  file_wbuf_t* b = f->wbuf;
+  ssize_t ret = size;
+
+  // A panic may come from inside a flush, with the lock held, so while
+  // panicking write straight through rather than wait for it
+  if (!panicking)
+    spinlock_lock(&b->lock);
+  else if (spinlock_trylock(&b->lock))
+    return file_xfer(f, SYS_write, SYS_writev, buf, size, 0);
+
+  if (b->len + size > FILE_WBUF_SIZE)
+  {
+    int r = __file_wbuf_flush(f, b);
+    if (r < 0)
+    {
+      spinlock_unlock(&b->lock);
+      return r;
+    }
+  }
+
+  if (size >= FILE_WBUF_SIZE)
+    ret = file_xfer(f, SYS_write, SYS_writev, buf, size, 0);
+  else
+  {
+    memcpy(b->data + b->len, buf, size);
+    b->len += size;
+    // A failure here leaves the data buffered for the next write or fsync
+    if (memchr(buf, '\n', size))
+      __file_wbuf_flush(f, b);
+  }
+
+  spinlock_unlock(&b->lock);
+  return ret;
+}
+
+int file_sync(file_t* f)
+{
+  file_wbuf_t* b = f->wbuf;
+  if (!b)
+    return 0;
+
+  spinlock_lock(&b->lock);
+  int ret = __file_wbuf_flush(f, b);
+  spinlock_unlock(&b->lock);
+  return ret;
+}
+
+// Used on the way down, possibly from a panic raised while a buffer was
+// being written, so a buffer that is already locked is skipped
+void file_sync_all()
+{
+  for (size_t c = 0; c < MAX_CHUNKS && file_chunks[c]; c++)
+  {
+    for (file_t* f = file_chunks[c]; f < file_chunks[c] + FILE_CHUNK; f++)
+    {
+      file_wbuf_t* b = f->wbuf;
+      if (b && b->len && !spinlock_trylock(&b->lock))
+      {
+        __file_wbuf_flush(f, b);
+        spinlock_unlock(&b->lock);
+      }
+    }
+  }
+}
+
+// Wait for a block's read-ahead, if any. Caller holds file_cache_lock.
+static void __file_cache_settle(file_cache_block_t* b)
+{
+  if (b->tag == -1)
+    return;
+
+  b->len = frontend_syscall_reap(b->tag);
+  b->tag = -1;
+  file_cache_inflight--;
+  if (b->len < 0)
+    b->kfd = -1;
+}
+
+static file_cache_block_t* __file_cache_find(int kfd, off_t off)
+{
+  for (file_cache_block_t* b = file_cache; b < file_cache + FILE_CACHE_BLOCKS; b++)
+    if (b->kfd == kfd && b->off == off)
+      return b;
+  return NULL;
+}
+
+static file_cache_block_t* __file_cache_victim()
+{
+  file_cache_block_t* victim = file_cache;
+  for (file_cache_block_t* b = file_cache; b < file_cache + FILE_CACHE_BLOCKS; b++)
+  {
+    if (b->kfd == -1)
+      return b;
+    if (b->used < victim->used)
+      victim = b;
+  }
+  __file_cache_settle(victim);
+  victim->kfd = -1;
+  return victim;
+}
+
+static char* file_cache_block_data(file_cache_block_t* b)
+{
+  return file_cache_data[b - file_cache];
+}
+
+static void __file_cache_readahead(int kfd, off_t off)
+{
+  if (file_cache_inflight >= FRONTEND_RING_SIZE / 2 || __file_cache_find(kfd, off))
+    return;
+
+  file_cache_block_t* b = __file_cache_victim();
+  b->kfd = kfd;
+  b->off = off;
+  b->used = ++file_cache_clock;
+  b->tag = frontend_syscall_submit(SYS_pread, kfd, va2pa(file_cache_block_data(b)),
+                                   FILE_CACHE_BLOCK_SIZE, off, 0, 0, 0);
+  file_cache_inflight++;
+}
+
+static void file_cache_inval(int kfd)
+{
+  spinlock_lock(&file_cache_lock);
+  for (file_cache_block_t* b = file_cache; b < file_cache + FILE_CACHE_BLOCKS; b++)
+  {
+    if (b->kfd == kfd || (kfd == FILE_CACHE_ALL && b->kfd != -1))
+    {
+      __file_cache_settle(b);
+      b->kfd = -1;
+    }
+  }
+  spinlock_unlock(&file_cache_lock);
+}
+
+// Caller holds file_cache_lock
+static ssize_t __file_cache_pread(file_t* f, void* buf, size_t size, off_t offset)
+{
+  // Large reads go straight into the caller's buffer
+  if (size >= FILE_CACHE_BLOCK_SIZE)
+    return file_xfer(f, SYS_pread, SYS_preadv, buf, size, offset);
+
+  size_t done = 0;
+  while (done < size)
+  {
+    off_t pos = offset + done;
+    off_t boff = ROUNDDOWN(pos, FILE_CACHE_BLOCK_SIZE);
+
+    file_cache_block_t* b = __file_cache_find(f->kfd, boff);
+    if (b)
+      __file_cache_settle(b);
+    if (!b || b->kfd == -1)
+    {
+      b = __file_cache_victim();
+      b->len = frontend_syscall(SYS_pread, f->kfd, va2pa(file_cache_block_data(b)),
+                                FILE_CACHE_BLOCK_SIZE, boff, 0, 0, 0);
+      if (b->len < 0)
+        return done ? done : b->len;
+      b->kfd = f->kfd;
+      b->off = boff;
+    }
+    b->used = ++file_cache_clock;
+
+    if (boff == f->ra_next && b->len == FILE_CACHE_BLOCK_SIZE)
+    {
+      f->ra_next = boff + FILE_CACHE_BLOCK_SIZE;
+      __file_cache_readahead(f->kfd, f->ra_next);
+    }
+
+    if (pos - boff >= b->len)
+      break;
+    size_t n = MIN(size - done, b->len - (pos - boff));
+    memcpy((char*)buf + done, file_cache_block_data(b) + (pos - boff), n);
+    done += n;
+
+    if (b->len < FILE_CACHE_BLOCK_SIZE)
+      break;
+  }
+
+  return done;
+}
+
+// Bring the host's offset for f in line with pos. Caller holds file_cache_lock.
+static void __file_sync_pos(file_t* f)
+{
+  if (f->pos_ahead)
+  {
+    frontend_syscall(SYS_lseek, f->kfd, f->pos, SEEK_SET, 0, 0, 0, 0);
+    f->pos_ahead = 0;
+  }
+}
+
+static ssize_t file_cached_read(file_t* f, void* buf, size_t size)
+{
+  ssize_t r;
+
+  spinlock_lock(&file_cache_lock);
+
+  if (f->pos < 0)
+  {
+    f->pos = frontend_syscall(SYS_lseek, f->kfd, 0, SEEK_CUR, 0, 0, 0, 0);
+    if (f->pos < 0)
+    {
+      r = f->pos;
+      goto out;
+    }
+  }
+
+  r = __file_cache_pread(f, buf, size, f->pos);
+  if (r > 0)
+  {
+    f->pos += r;
+    f->pos_ahead = 1;
+  }
+
+out:
+  spinlock_unlock(&file_cache_lock);
+  return r;
+}
+
+// Writes through a cached file may move the host's offset arbitrarily
+// (O_APPEND), so pos is forgotten until the next read asks for it
+static void file_cache_before_write(file_t* f)
+{
+  spinlock_lock(&file_cache_lock);
+  __file_sync_pos(f);
+  f->pos = -1;
+  spinlock_unlock(&file_cache_lock);
+
+  file_cache_inval(FILE_CACHE_ALL);
+}
+
+static ssize_t file_ram_pread(file_t* f, void* buf, size_t size, off_t offset)
+{
+  if (!S_ISREG(f->ram.mode))
+    return S_ISDIR(f->ram.mode) ? -EISDIR : -EINVAL;
+  if (offset < 0)
+    return -EINVAL;
+  if (offset >= f->ram.size)
+    return 0;
+
+  size = MIN(size, f->ram.size - offset);
+  memcpy(buf, f->ram.data + offset, size);
+  return size;
+}
+
 ssize_t file_read(file_t* f, void* buf, size_t size)
 {
+  // Let prompts reach the console before blocking on input
+  if (f == stdin)
+    file_sync_all();
+
   populate_mapping(buf, size, PROT_WRITE);
-  return frontend_syscall(SYS_read, f->kfd, va2pa(buf), size, 0, 0, 0, 0);
+  if (f->ram.data)
+  {
+    ssize_t r = file_ram_pread(f, buf, size, f->pos);
+    if (r > 0)
+      f->pos += r;
+    return r;
+  }
+  if (f->cached)
+    return file_cached_read(f, buf, size);
+  return file_xfer(f, SYS_read, SYS_readv, buf, size, 0);
 }
 
 ssize_t file_pread(file_t* f, void* buf, size_t size, off_t offset)
 {
   populate_mapping(buf, size, PROT_WRITE);
-  return frontend_syscall(SYS_pread, f->kfd, va2pa(buf), size, offset, 0, 0, 0);
+  if (f->ram.data)
+    return file_ram_pread(f, buf, size, offset);
+  if (f->cached)
+  {
+    spinlock_lock(&file_cache_lock);
+    ssize_t r = __file_cache_pread(f, buf, size, offset);
+    spinlock_unlock(&file_cache_lock);
+    return r;
+  }
+  return file_xfer(f, SYS_pread, SYS_preadv, buf, size, offset);
 }
 
 ssize_t file_write(file_t* f, const void* buf, size_t size)
 {
+  if (f->ram.data)
+    return -EBADF;
   populate_mapping(buf, size, PROT_READ);
-  return frontend_syscall(SYS_write, f->kfd, va2pa(buf), size, 0, 0, 0, 0);
+  if (f->wbuf)
+    return file_write_buffered(f, buf, size);
+  if (f->cached)
+    file_cache_before_write(f);
+  return file_xfer(f, SYS_write, SYS_writev, buf, size, 0);
 }
 
 ssize_t file_pwrite(file_t* f, const void* buf, size_t size, off_t offset)
 {
+  if (f->ram.data)
+    return -EBADF;
   populate_mapping(buf, size, PROT_READ);
-  return frontend_syscall(SYS_pwrite, f->kfd, va2pa(buf), size, offset, 0, 0, 0);
+  if (f->cached)
+    file_cache_inval(FILE_CACHE_ALL);
+  return file_xfer(f, SYS_pwrite, SYS_pwritev, buf, size, offset);
+}
+
+static void populate_iov(const long* iov, int cnt, int prot)
+{
+  for (int i = 0; i < cnt; i++)
+    populate_mapping((void*)iov[2*i], iov[2*i+1], prot);
+}
+
+// Handle each buffer separately, for files whose reads or writes are
+// served from a kernel buffer rather than forwarded to the host
+static ssize_t file_loopv(file_t* f, long n, const long* iov, int cnt, off_t offset)
+{
+  ssize_t done = 0;
+  for (int i = 0; i < cnt; i++)
+  {
+    void* buf = (void*)iov[2*i];
+    ssize_t r;
+    switch (n)
+    {
+      case SYS_read: r = file_read(f, buf, iov[2*i+1]); break;
+      case SYS_pread: r = file_pread(f, buf, iov[2*i+1], offset + done); break;
+      default: r = file_write(f, buf, iov[2*i+1]); break;
+    }
+    if (r < 0)
+      return done ? done : r;
+    done += r;
+    if (r < iov[2*i+1])
+      break;
+  }
+  return done;
+}
+
+ssize_t file_readv(file_t* f, const long* iov, int cnt)
+{
+  if (f->cached || f->ram.data || f == stdin)
+    return file_loopv(f, SYS_read, iov, cnt, 0);
+  populate_iov(iov, cnt, PROT_WRITE);
+  return file_xferv(f, SYS_read, SYS_readv, iov, cnt, 0);
+}
+
+ssize_t file_preadv(file_t* f, const long* iov, int cnt, off_t offset)
+{
+  if (f->cached || f->ram.data)
+    return file_loopv(f, SYS_pread, iov, cnt, offset);
+  populate_iov(iov, cnt, PROT_WRITE);
+  return file_xferv(f, SYS_pread, SYS_preadv, iov, cnt, offset);
+}
+
+ssize_t file_writev(file_t* f, const long* iov, int cnt)
+{
+  if (f->ram.data)
+    return -EBADF;
+  if (f->wbuf)
+    return file_loopv(f, SYS_write, iov, cnt, 0);
+  if (f->cached)
+    file_cache_before_write(f);
+  populate_iov(iov, cnt, PROT_READ);
+  return file_xferv(f, SYS_write, SYS_writev, iov, cnt, 0);
+}
+
+ssize_t file_pwritev(file_t* f, const long* iov, int cnt, off_t offset)
+{
+  if (f->ram.data)
+    return -EBADF;
+  if (f->cached)
+    file_cache_inval(FILE_CACHE_ALL);
+  populate_iov(iov, cnt, PROT_READ);
+  return file_xferv(f, SYS_pwrite, SYS_pwritev, iov, cnt, offset);
 }
 
 int file_stat(file_t* f, struct stat* s)
 {
+  if (f->ram.data)
+  {
+    ramfs_stat(&f->ram, s);
+    return 0;
+  }
+
   struct frontend_stat buf;
   long ret = frontend_syscall(SYS_fstat, f->kfd, va2pa(&buf), 0, 0, 0, 0, 0);
   copy_stat(s, &buf);
@@ -151,10 +769,46 @@ int file_stat(file_t* f, struct stat* s)
 
 int file_truncate(file_t* f, off_t len)
 {
+  if (f->ram.data)
+    return -EBADF;
+  if (f->cached)
+    file_cache_inval(FILE_CACHE_ALL);
   return frontend_syscall(SYS_ftruncate, f->kfd, len, 0, 0, 0, 0, 0);
 }
 
+static ssize_t file_ram_lseek(file_t* f, off_t ptr, int dir)
+{
+  switch (dir)
+  {
+    case SEEK_SET: break;
+    case SEEK_CUR: ptr += f->pos; break;
+    case SEEK_END: ptr += f->ram.size; break;
+    default: return -EINVAL;
+  }
+  if (ptr < 0)
+    return -EINVAL;
+  return f->pos = ptr;
+}
+
 ssize_t file_lseek(file_t* f, size_t ptr, int dir)
 {
-  return frontend_syscall(SYS_lseek, f->kfd, ptr, dir, 0, 0, 0, 0);
+  if (f->ram.data)
+    return file_ram_lseek(f, ptr, dir);
+  if (!f->cached)
+    return frontend_syscall(SYS_lseek, f->kfd, ptr, dir, 0, 0, 0, 0);
+
+  spinlock_lock(&file_cache_lock);
+  if (dir == SEEK_CUR && f->pos >= 0)
+  {
+    ptr += f->pos;
+    dir = SEEK_SET;
+  }
+  ssize_t r = frontend_syscall(SYS_lseek, f->kfd, ptr, dir, 0, 0, 0, 0);
+  if (r >= 0)
+  {
+    f->pos = r;
+    f->pos_ahead = 0;
+  }
+  spinlock_unlock(&file_cache_lock);
+  return r;
 }
@@ -6,11 +6,28 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include "atomic.h"
+#include "ramfs.h"
+
+// Write-behind buffer for console descriptors
+#define FILE_WBUF_SIZE 1024
+typedef struct file_wbuf
+{
+  spinlock_t lock;
+  size_t len;
+  char data[FILE_WBUF_SIZE];
+} file_wbuf_t;
 
 typedef struct file
 {
   int kfd; // file descriptor on the host side of the HTIF
   uint32_t refcnt;
+  file_wbuf_t* wbuf; // non-NULL if writes are buffered
+  uint8_t cached;    // regular file; reads go through the read cache
+  uint8_t pos_ahead; // pos has moved past the host's offset for kfd
+  off_t pos;         // current offset if cached, or -1 if only the host knows
+  off_t ra_next;     // block offset that would continue a sequential read
+  ramfs_node_t ram;  // initrd file served from memory, if ram.data is set
 } file_t;
 
 extern file_t files[];
@@ -29,9 +46,15 @@ ssize_t file_pwrite(file_t* f, const void* buf, size_t n, off_t off);
 ssize_t file_pread(file_t* f, void* buf, size_t n, off_t off);
 ssize_t file_write(file_t* f, const void* buf, size_t n);
 ssize_t file_read(file_t* f, void* buf, size_t n);
+ssize_t file_readv(file_t* f, const long* iov, int cnt);
+ssize_t file_preadv(file_t* f, const long* iov, int cnt, off_t off);
+ssize_t file_writev(file_t* f, const long* iov, int cnt);
+ssize_t file_pwritev(file_t* f, const long* iov, int cnt, off_t off);
 ssize_t file_lseek(file_t* f, size_t ptr, int dir);
 int file_truncate(file_t* f, off_t len);
 int file_stat(file_t* f, struct stat* s);
+int file_sync(file_t* f);
+void file_sync_all();
 int fd_close(int fd);
 
 void file_init();
@@ -5,34 +5,114 @@
 #include "frontend.h"
 #include "syscall.h"
 #include "htif.h"
+#include "file.h"
+#include "mmap.h"
+#include "bits.h"
 #include <stdint.h>
 
-long frontend_syscall(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6)
+// Requests in flight to the host. A slot is tagged with the request that
+// owns it and freed when that request is reaped. Tags encode the slot index
+// so that a request left unreaped (e.g. a read-ahead) only pins its own slot.
+struct frontend_slot {
+  volatile uint64_t magic_mem[8];
+  volatile long tag;
+  uint64_t seq; // HTIF completion sequence number
+};
+
+static struct frontend_slot ring[FRONTEND_RING_SIZE] =
+  {[0 ... FRONTEND_RING_SIZE-1] = {.tag = -1}};
+static spinlock_t ring_lock = SPINLOCK_INIT;
+static long next_tag;
+
+uint64_t frontend_host_cycles;
+
+long frontend_syscall_submit(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6)
 {
-  static volatile uint64_t magic_mem[8];
+  spinlock_lock(&ring_lock);
+
+  struct frontend_slot* s = ring;
+  while (s->tag != -1)
+    s = s == &ring[FRONTEND_RING_SIZE-1] ? ring : s + 1;
+  long tag = next_tag++ * FRONTEND_RING_SIZE + (s - ring);
 
-  static spinlock_t lock = SPINLOCK_INIT;
-  spinlock_lock(&lock);
+  s->magic_mem[0] = n;
+  s->magic_mem[1] = a0;
+  s->magic_mem[2] = a1;
+  s->magic_mem[3] = a2;
+  s->magic_mem[4] = a3;
+  s->magic_mem[5] = a4;
+  s->magic_mem[6] = a5;
+  s->magic_mem[7] = a6;
+  s->tag = tag;
 
-  magic_mem[0] = n;
-  magic_mem[1] = a0;
-  magic_mem[2] = a1;
-  magic_mem[3] = a2;
-  magic_mem[4] = a3;
-  magic_mem[5] = a4;
-  magic_mem[6] = a5;
-  magic_mem[7] = a6;
+  uint64_t c0 = rdcycle();
+  s->seq = htif_syscall_post((uintptr_t)s->magic_mem);
+  frontend_host_cycles += rdcycle() - c0;
 
-  htif_syscall((uintptr_t)magic_mem);
+  spinlock_unlock(&ring_lock);
+  return tag;
+}
+
+int frontend_syscall_done(long tag)
+{
+  struct frontend_slot* s = &ring[tag % FRONTEND_RING_SIZE];
+  kassert(s->tag == tag);
+  return htif_syscall_poll(s->seq);
+}
+
+long frontend_syscall_reap(long tag)
+{
+  struct frontend_slot* s = &ring[tag % FRONTEND_RING_SIZE];
+  kassert(s->tag == tag);
 
-  long ret = magic_mem[0];
+  uint64_t c0 = rdcycle();
+  while (!htif_syscall_poll(s->seq))
+    ;
+  frontend_host_cycles += rdcycle() - c0;
 
-  spinlock_unlock(&lock);
+  long ret = s->magic_mem[0];
+  mb();
+  s->tag = -1;
   return ret;
 }
 
+long frontend_syscall(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6)
+{
+  return frontend_syscall_reap(frontend_syscall_submit(n, a0, a1, a2, a3, a4, a5, a6));
+}
+
+size_t frontend_iov_build(struct frontend_iov* iov, size_t max,
+                          const void* buf, size_t size, size_t* covered)
+{
+  uintptr_t va = (uintptr_t)buf, end = va + size;
+  size_t cnt = 0;
+
+  while (va < end)
+  {
+    size_t len = MIN(end - va, RISCV_PGSIZE - (va & (RISCV_PGSIZE-1)));
+    uintptr_t pa = va2pa((void*)va);
+
+    if (cnt && iov[cnt-1].base + iov[cnt-1].len == pa)
+      iov[cnt-1].len += len;
+    else if (cnt == max)
+      break;
+    else
+    {
+      iov[cnt].base = pa;
+      iov[cnt].len = len;
+      cnt++;
+    }
+    va += len;
+  }
+
+  *covered = va - (uintptr_t)buf;
+  return cnt;
+}
+
 void shutdown(int code)
 {
+  syscall_prof_dump();
+  file_sync_all();
   frontend_syscall(SYS_exit, code, 0, 0, 0, 0, 0, 0);
   while (1);
 }
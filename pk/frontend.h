@@ -4,11 +4,39 @@
 #define _RISCV_FRONTEND_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 void shutdown(int) __attribute__((noreturn));
 long frontend_syscall(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6);
 
+// Split-phase host syscalls. submit() posts the request without waiting and
+// returns a tag; reap() waits for that request and returns its result. Any
+// buffers passed to the host must stay live until the tag is reaped, and no
+// caller may hold more than FRONTEND_RING_SIZE unreaped tags.
+#define FRONTEND_RING_SIZE 8
+long frontend_syscall_submit(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6);
+int frontend_syscall_done(long tag);
+long frontend_syscall_reap(long tag);
+
+// Cycles spent posting requests to and waiting on the host
+extern uint64_t frontend_host_cycles;
+
+// A physically contiguous piece of a buffer handed to the host
+struct frontend_iov {
+  uint64_t base;
+  uint64_t len;
+};
+
+// Kept small: the list lives on the one-page kernel stack
+#define FRONTEND_IOV_MAX 16
+
+// Split [buf, buf+size) into at most max physical extents, merging pages
+// that happen to be physically adjacent. Returns the number of extents and
+// stores the number of bytes they cover in *covered.
+size_t frontend_iov_build(struct frontend_iov* iov, size_t max,
+                          const void* buf, size_t size, size_t* covered);
+
 struct frontend_stat {
   uint64_t dev;
   uint64_t ino;
@@ -79,6 +79,26 @@ static void handle_access_fault(trapframe_t* tf)
   panic("Memory Access Fault");
 }
 
+// Called from trap_entry for syscalls and page faults with only the
+// caller-saved registers, sp and the trap CSRs in tf. Returns nonzero to have
+// the frame completed and the trap handed to handle_trap_fallback instead.
+long handle_fast_trap(trapframe_t* tf)
+{
+  switch (tf->cause)
+  {
+    case CAUSE_USER_ECALL:
+      handle_syscall(tf);
+      return 0;
+    case CAUSE_FETCH_PAGE_FAULT:
+      return handle_page_fault(tf->badvaddr, PROT_EXEC);
+    case CAUSE_LOAD_PAGE_FAULT:
+      return handle_page_fault(tf->badvaddr, PROT_READ);
+    case CAUSE_STORE_PAGE_FAULT:
+      return handle_page_fault(tf->badvaddr, PROT_WRITE);
+  }
+  return -1;
+}
+
 void handle_trap(trapframe_t* tf)
 {
   if ((intptr_t)tf->cause < 0)
@@ -106,3 +126,20 @@ void handle_trap(trapframe_t* tf)
 
   trap_handlers[tf->cause](tf);
 }
+
+// Called from trap_entry, with the frame completed, when handle_fast_trap
+// returns nonzero. A page fault has then already been through
+// handle_page_fault once and must not be retried.
+void handle_trap_fallback(trapframe_t* tf)
+{
+  switch (tf->cause)
+  {
+    case CAUSE_FETCH_PAGE_FAULT:
+      return segfault(tf, tf->badvaddr, "fetch");
+    case CAUSE_LOAD_PAGE_FAULT:
+      return segfault(tf, tf->badvaddr, "load");
+    case CAUSE_STORE_PAGE_FAULT:
+      return segfault(tf, tf->badvaddr, "store");
+  }
+  handle_trap(tf);
+}
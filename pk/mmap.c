@@ -8,6 +8,11 @@
 #include <stdint.h>
 #include <errno.h>
 
+// A VMR describes one mmap'd range. Every PTE it placed holds a reference,
+// whether the page is unfaulted, resident or remote; only unfaulted PTEs
+// point at the VMR, so the others find it by address. VMRs may overlap after
+// a range is partly mapped over, and the newest one covering an address is
+// the one that placed its page, as any later mapping would have replaced it.
 typedef struct {
   uintptr_t addr;
   size_t length;
@@ -15,11 +20,37 @@ typedef struct {
   size_t offset;
   unsigned refcnt;
   int prot;
+  unsigned long gen; // creation order
 } vmr_t;
 
 #define MAX_VMR (RISCV_PGSIZE / sizeof(vmr_t))
 static spinlock_t vm_lock = SPINLOCK_INIT;
 static vmr_t* vmrs;
+static unsigned long vmr_gen;
+
+// Software PTE bit: the page is mapped read-only but its VMR allows writes,
+// so a store fault must give it a private frame rather than fail.
+#define PTE_COW 0x100
+
+// Shared frame backing every untouched anonymous page that has only been read
+static uintptr_t zero_page;
+
+// pk runs a single address space; fences are scoped to its ASID
+#define PK_ASID 0
+
+// A private page's frame is normally fixed by its VA (see user_frame), but
+// mremap moves PTEs along with their frames. The two VAs then trade frames,
+// so each still owns exactly one. Trades are kept here, hashed on VPN, until
+// a VA gets its own frame back.
+#define FRAME_SWAPS 2048
+#define FRAME_SWAPS_MAX (FRAME_SWAPS / 4 * 3) // keeps probe chains short
+typedef struct {
+  uintptr_t vpn; // -1 if free
+  uintptr_t ppn;
+} frame_swap_t;
+static frame_swap_t frame_swaps[FRAME_SWAPS] =
+  {[0 ... FRAME_SWAPS-1] = {.vpn = -1}};
+static size_t frame_swaps_used;
 
 uintptr_t first_free_paddr;
 static uintptr_t first_free_page;
@@ -28,14 +59,22 @@ static size_t free_pages;
 
 int demand_paging; // unless -p flag is given
 
-static uintptr_t __page_alloc()
+static uintptr_t __page_try_alloc()
 {
-  kassert(next_free_page != free_pages);
+  if (next_free_page == free_pages)
+    return 0;
   uintptr_t addr = first_free_page + RISCV_PGSIZE * next_free_page++;
   memset((void*)addr, 0, RISCV_PGSIZE);
   return addr;
 }
 
+static uintptr_t __page_alloc()
+{
+  uintptr_t addr = __page_try_alloc();
+  kassert(addr);
+  return addr;
+}
+
 static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
                           size_t offset, unsigned refcnt, int prot)
 {
@@ -60,12 +99,23 @@ static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
       v->offset = offset;
       v->refcnt = refcnt;
       v->prot = prot;
+      v->gen = ++vmr_gen;
       return v;
     }
   }
   return NULL;
 }
 
+static size_t __vmr_free()
+{
+  if (!vmrs)
+    return MAX_VMR;
+  size_t n = 0;
+  for (vmr_t* v = vmrs; v < vmrs + MAX_VMR; v++)
+    n += v->refcnt == 0;
+  return n;
+}
+
 static void __vmr_decref(vmr_t* v, unsigned dec)
 {
   if ((v->refcnt -= dec) == 0)
@@ -75,6 +125,72 @@ static void __vmr_decref(vmr_t* v, unsigned dec)
   }
 }
 
+// The VMR that placed the page at addr
+static vmr_t* __vmr_find(uintptr_t addr)
+{
+  vmr_t* found = NULL;
+  for (vmr_t* v = vmrs; v && v < vmrs + MAX_VMR; v++)
+    if (v->refcnt && addr - v->addr < v->length && (!found || v->gen > found->gen))
+      found = v;
+  return found;
+}
+
+// The VMR holding a reference for *pte, the PTE at addr
+static vmr_t* __pte_vmr(uintptr_t addr, pte_t* pte)
+{
+  if ((*pte & PTE_V) || pte_is_remote(*pte))
+    return __vmr_find(addr);
+  return (vmr_t*)*pte;
+}
+
+static frame_swap_t* __frame_swap_slot(uintptr_t vpn)
+{
+  size_t i = vpn % FRAME_SWAPS;
+  while (frame_swaps[i].vpn != (uintptr_t)-1 && frame_swaps[i].vpn != vpn)
+    i = (i + 1) % FRAME_SWAPS;
+  return &frame_swaps[i];
+}
+
+// The frame the private page at vpn gets when it faults in
+static uintptr_t __frame_ppn(uintptr_t vpn)
+{
+  frame_swap_t* s = __frame_swap_slot(vpn);
+  return s->vpn == vpn ? s->ppn : vpn + first_free_paddr / RISCV_PGSIZE;
+}
+
+static int __frame_swap_home_between(size_t i, size_t home, size_t j)
+{
+  return i < j ? i < home && home <= j : i < home || home <= j;
+}
+
+static void __frame_set(uintptr_t vpn, uintptr_t ppn)
+{
+  frame_swap_t* s = __frame_swap_slot(vpn);
+  if (ppn != vpn + first_free_paddr / RISCV_PGSIZE) {
+    if (s->vpn != vpn) {
+      s->vpn = vpn;
+      frame_swaps_used++;
+    }
+    s->ppn = ppn;
+    return;
+  }
+  if (s->vpn != vpn)
+    return;
+
+  // Back to its own frame: delete, shifting later entries of the probe
+  // chain back so that none is cut off from its home slot
+  frame_swaps_used--;
+  size_t i = s - frame_swaps;
+  for (size_t j = (i + 1) % FRAME_SWAPS; frame_swaps[j].vpn != (uintptr_t)-1;
+       j = (j + 1) % FRAME_SWAPS) {
+    if (!__frame_swap_home_between(i, frame_swaps[j].vpn % FRAME_SWAPS, j)) {
+      frame_swaps[i] = frame_swaps[j];
+      i = j;
+    }
+  }
+  frame_swaps[i].vpn = -1;
+}
+
 static size_t pte_ppn(pte_t pte)
 {
   return pte >> PTE_PPN_SHIFT;
@@ -157,6 +273,18 @@ static inline pte_t prot_to_type(int prot, int user)
   return pte;
 }
 
+static int pte_to_prot(pte_t pte)
+{
+  if (pte_is_remote(pte))
+    pte >>= PFA_PROT_SHIFT;
+
+  int prot = 0;
+  if (pte & PTE_R) prot |= PROT_READ;
+  if (pte & (PTE_W | PTE_COW)) prot |= PROT_WRITE;
+  if (pte & PTE_X) prot |= PROT_EXEC;
+  return prot;
+}
+
 int __valid_user_range(uintptr_t vaddr, size_t len)
 {
   if (vaddr + len < vaddr)
@@ -164,6 +292,16 @@ int __valid_user_range(uintptr_t vaddr, size_t len)
   return vaddr + len <= current.mmap_max;
 }
 
+static int __va_range_avail(uintptr_t vaddr, size_t len)
+{
+  if (!__valid_user_range(vaddr, len))
+    return 0;
+  for (uintptr_t a = vaddr; a < vaddr + len; a += RISCV_PGSIZE)
+    if (!__va_avail(a))
+      return 0;
+  return 1;
+}
+
 static int __handle_page_fault(uintptr_t vaddr, int prot)
 {
   uintptr_t vpn = vaddr >> RISCV_PGSHIFT;
@@ -178,7 +316,7 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
     printk("Saw page fault on test_inval special addr\n");
     test_inval_touched = true;
     *pte |= PTE_V;
-    flush_tlb();
+    flush_tlb_va(vaddr);
     return 0;
   }
 
@@ -229,7 +367,7 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
           printk("error polling for eviction\n");
       }
 
-      flush_tlb();
+      flush_tlb_va(vaddr);
       return 0;
     } else if (current_exp == PFA_EXP_NEWVADDR_FAULT) {
       printk("Fault handler for newvaddr_fault test\n");
@@ -248,7 +386,7 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
       assert(pfa_check_newpage() == PFA_NEW_MAX - 1);
 
       /* The PFA should kick in now and bring in the page */
-      flush_tlb();
+      flush_tlb_va(vaddr);
       printk("Leaving fault handler\n");
       return 0;
     } else if (current_exp == PFA_EXP_NEWPGID_FAULT) {
@@ -268,7 +406,7 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
       assert(pfa_check_newpage() == PFA_NEW_MAX - 1);
 
       /* The PFA should kick in now and bring in the page */
-      flush_tlb();
+      flush_tlb_va(vaddr);
       printk("Leaving fault handler\n");
       return 0;
     } else if (current_exp == PFA_EXP_EMPTYQ) {
@@ -276,7 +414,7 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
       assert(test_paddr != 0);
       /* Map the page back to its original paddr (we never actually evicted it, just marked it remote) */
       *pte = pte_create(test_paddr >> RISCV_PGSHIFT, prot_to_type(PROT_READ|PROT_WRITE, 0));
-      flush_tlb();
+      flush_tlb_va(vaddr);
       return 0;
     }else {
       printk("Saw page fault in unrecognized experiment\n");
@@ -287,11 +425,36 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
   if (pte == 0 || *pte == 0 || !__valid_user_range(vaddr, 1)) {
     return -1;
   } else if (!(*pte & PTE_V)) {
-    uintptr_t ppn = vpn + (first_free_paddr / RISCV_PGSIZE);
+    uintptr_t ppn = __frame_ppn(vpn);
 
     vmr_t* v = (vmr_t*)*pte;
+    if (!v->file && !(prot & PROT_WRITE))
+    {
+      // Reads of untouched anonymous memory see the shared zero page.
+      // If the region is writable, the first store takes a COW fault.
+      pte_t type = prot_to_type(v->prot & ~PROT_WRITE, 1);
+      if (v->prot & PROT_WRITE)
+        type |= PTE_COW;
+      *pte = pte_create(zero_page >> RISCV_PGSHIFT, type);
+      flush_tlb_va(vaddr);
+      return 0;
+    }
+
+    uintptr_t image_page;
+    if (v->file && v->file->ram.data && !(prot & PROT_WRITE) &&
+        (image_page = ramfs_page(&v->file->ram, vaddr - v->addr + v->offset)))
+    {
+      // initrd pages are mapped in place, copy-on-write if writable
+      pte_t type = prot_to_type(v->prot & ~PROT_WRITE, 1);
+      if (v->prot & PROT_WRITE)
+        type |= PTE_COW;
+      *pte = pte_create(image_page >> RISCV_PGSHIFT, type);
+      flush_tlb_va(vaddr);
+      return 0;
+    }
+
     *pte = pte_create(ppn, prot_to_type(PROT_READ|PROT_WRITE, 0));
-    flush_tlb();
+    flush_tlb_va(vaddr);
     if (v->file)
     {
       size_t flen = MIN(RISCV_PGSIZE, v->length - (vaddr - v->addr));
@@ -302,15 +465,28 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
     }
     else
       memset((void*)vaddr, 0, RISCV_PGSIZE);
-    __vmr_decref(v, 1);
     *pte = pte_create(ppn, prot_to_type(v->prot, 1));
+  } else if ((*pte & PTE_COW) && (prot & PROT_WRITE)) {
+    // First store to a shared page (the zero page or an initrd page): give
+    // it its own frame. The source is reached through the kernel mapping.
+    uintptr_t ppn = __frame_ppn(vpn);
+    uintptr_t src = pte_ppn(*pte) << RISCV_PGSHIFT;
+    pte_t type = (*pte & (PTE_R | PTE_X | PTE_A | PTE_U)) | PTE_W | PTE_D;
+
+    *pte = pte_create(ppn, prot_to_type(PROT_READ|PROT_WRITE, 0));
+    flush_tlb_va(vaddr);
+    if (src == zero_page)
+      memset((void*)vaddr, 0, RISCV_PGSIZE);
+    else
+      memcpy((void*)vaddr, (void*)src, RISCV_PGSIZE);
+    *pte = pte_create(ppn, type);
   }
 
   pte_t perms = pte_create(0, prot_to_type(prot, 1));
   if ((*pte & perms) != perms)
     return -1;
 
-  flush_tlb();
+  flush_tlb_va(vaddr);
   return 0;
 }
 
@@ -324,18 +500,23 @@ int handle_page_fault(uintptr_t vaddr, int prot)
 
 static void __do_munmap(uintptr_t addr, size_t len)
 {
+  tlb_batch_t batch = TLB_BATCH_INIT;
+
   for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk(a);
     if (pte == 0 || *pte == 0)
       continue;
 
-    if (!(*pte & PTE_V))
-      __vmr_decref((vmr_t*)*pte, 1);
+    if (*pte & PTE_V)
+      tlb_batch_add(&batch, a);
+    vmr_t* v = __pte_vmr(a, pte);
+    if (v)
+      __vmr_decref(v, 1);
 
     *pte = 0;
   }
-  flush_tlb(); // TODO: shootdown
+  tlb_batch_flush(&batch); // TODO: shootdown
 }
 
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* f, off_t offset)
@@ -351,20 +532,19 @@ uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t*
     return (uintptr_t)-1;
   }
 
-  vmr_t* v = __vmr_alloc(addr, length, f, offset, npage, prot);
-  if (!v) {
+  // Whatever is mapped there goes first, while the VMRs that placed it are
+  // still the newest covering it
+  if (__vmr_free() == 0) {
     printk("bad __vmr_alloc\n");
     return (uintptr_t)-1;
   }
+  __do_munmap(addr, length);
+  vmr_t* v = __vmr_alloc(addr, length, f, offset, npage, prot);
 
   for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk_create(a);
     kassert(pte);
-
-    if (*pte)
-      __do_munmap(a, RISCV_PGSIZE);
-
     *pte = (pte_t)v;
   }
 
@@ -437,13 +617,154 @@ uintptr_t do_brk(size_t addr)
   return addr;
 }
 
+// Relocate [old_addr, old_addr + len) to the empty range at new_addr
+// without touching the data: resident and remote PTEs move as they are,
+// keeping their frames, and the two VAs of each resident page trade frame
+// ownership (see frame_swaps). Each VMR's references move to a copy of it
+// clipped to the range and shifted by the same distance, so file offsets
+// still resolve. Fails with -ENOMEM, having moved nothing, unless the VMRs
+// and frame trades needed, plus a VMR for the caller to grow the range
+// with, are all available.
+static int __move_ptes(uintptr_t old_addr, uintptr_t new_addr, size_t len)
+{
+  tlb_batch_t batch = TLB_BATCH_INIT;
+  uintptr_t delta = new_addr - old_addr;
+  vmr_t *old_vmr = NULL, *new_vmr = NULL;
+  size_t vmrs_needed = 1, swaps_needed = 0;
+
+  for (size_t off = 0; off < len; off += RISCV_PGSIZE)
+  {
+    pte_t* src = __walk(old_addr + off);
+    if (src == 0 || *src == 0)
+      continue;
+    vmr_t* v = __pte_vmr(old_addr + off, src);
+    if (v && v != old_vmr)
+      vmrs_needed++;
+    old_vmr = v;
+    if ((*src & PTE_V) && pte_ppn(*src) == __frame_ppn((old_addr + off) >> RISCV_PGSHIFT))
+      swaps_needed += 2;
+  }
+  if (__vmr_free() < vmrs_needed || frame_swaps_used + swaps_needed > FRAME_SWAPS_MAX)
+    return -ENOMEM;
+
+  old_vmr = NULL;
+  for (size_t off = 0; off < len; off += RISCV_PGSIZE)
+  {
+    pte_t* src = __walk(old_addr + off);
+    if (src == 0 || *src == 0)
+      continue;
+
+    pte_t* dst = __walk_create(new_addr + off);
+    kassert(dst);
+
+    pte_t pte = *src;
+    vmr_t* v = __pte_vmr(old_addr + off, src);
+    if (v)
+    {
+      if (v != old_vmr)
+      {
+        uintptr_t lo = MAX(v->addr, old_addr);
+        uintptr_t hi = MIN(v->addr + v->length, old_addr + len);
+        new_vmr = __vmr_alloc(lo + delta, hi - lo, v->file,
+                              v->offset + (lo - v->addr), 0, v->prot);
+        kassert(new_vmr); // reserved above
+        old_vmr = v;
+      }
+      new_vmr->refcnt++;
+      __vmr_decref(v, 1);
+      if (!(pte & PTE_V) && !pte_is_remote(pte))
+        pte = (pte_t)new_vmr;
+    }
+
+    if (pte & PTE_V)
+    {
+      // Only a page on its VA's own frame trades; a shared page (the zero
+      // page or an initrd page, COW or not) belongs to no VA
+      uintptr_t old_vpn = (old_addr + off) >> RISCV_PGSHIFT;
+      uintptr_t new_vpn = (new_addr + off) >> RISCV_PGSHIFT;
+      tlb_batch_add(&batch, old_addr + off);
+      if (pte_ppn(pte) == __frame_ppn(old_vpn))
+      {
+        __frame_set(old_vpn, __frame_ppn(new_vpn));
+        __frame_set(new_vpn, pte_ppn(pte));
+      }
+    }
+
+    *dst = pte;
+    *src = 0;
+  }
+  tlb_batch_flush(&batch);
+  return 0;
+}
+
+// Map [addr + old_size, addr + new_size) so that it continues the mapping
+// that ends at addr + old_size.
+static uintptr_t __mremap_extend(uintptr_t addr, size_t old_size, size_t new_size,
+                                 file_t* f, size_t offset, int prot)
+{
+  int flags = MAP_FIXED | MAP_PRIVATE | (f ? 0 : MAP_ANONYMOUS);
+  uintptr_t tail = addr + old_size;
+  if (__do_mmap(tail, new_size - old_size, prot, flags, f, offset) != tail)
+    return -ENOMEM;
+  return addr;
+}
+
 uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags)
 {
-  return -ENOSYS;
+  if ((addr & (RISCV_PGSIZE-1)) || old_size == 0 || new_size == 0 ||
+      (flags & ~MREMAP_MAYMOVE) || !__valid_user_range(addr, old_size))
+    return -EINVAL;
+
+  old_size = ROUNDUP(old_size, RISCV_PGSIZE);
+  new_size = ROUNDUP(new_size, RISCV_PGSIZE);
+
+  uintptr_t res = addr;
+  spinlock_lock(&vm_lock);
+    if (new_size <= old_size) {
+      __do_munmap(addr + new_size, old_size - new_size);
+      goto out;
+    }
+
+    // The new tail continues whatever backs the last page of the old range
+    uintptr_t last = addr + old_size - RISCV_PGSIZE;
+    pte_t* pte = __walk(last);
+    if (pte == 0 || *pte == 0) {
+      res = -EFAULT;
+      goto out;
+    }
+
+    vmr_t* v = __pte_vmr(last, pte);
+    int prot = v ? v->prot : pte_to_prot(*pte);
+    file_t* f = v ? v->file : NULL;
+    size_t offset = v ? v->offset + (addr + old_size - v->addr) : 0;
+
+    if (__va_range_avail(addr + old_size, new_size - old_size)) {
+      res = __mremap_extend(addr, old_size, new_size, f, offset, prot);
+    } else if (!(flags & MREMAP_MAYMOVE)) {
+      res = -ENOMEM;
+    } else if ((res = __vm_alloc(new_size / RISCV_PGSIZE)) == 0) {
+      res = -ENOMEM;
+    } else {
+      if (f)
+        file_incref(f);
+      uintptr_t moved = res;
+      if ((res = __move_ptes(addr, moved, old_size)) == 0)
+        res = __mremap_extend(moved, old_size, new_size, f, offset, prot);
+      if (f)
+        file_decref(f);
+
+      if (!IS_ERR_VALUE(res) && res < current.brk_max)
+        current.brk_max = res;
+    }
+out:
+  spinlock_unlock(&vm_lock);
+
+  return res;
 }
 
 uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
 {
+  tlb_batch_t batch = TLB_BATCH_INIT;
   uintptr_t res = 0;
   if ((addr) & (RISCV_PGSIZE-1))
     return -EINVAL;
@@ -468,18 +789,22 @@ uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
       } else {
         if (!(*pte & PTE_U) ||
             ((prot & PROT_READ) && !(*pte & PTE_R)) ||
-            ((prot & PROT_WRITE) && !(*pte & PTE_W)) ||
+            ((prot & PROT_WRITE) && !(*pte & (PTE_W | PTE_COW))) ||
             ((prot & PROT_EXEC) && !(*pte & PTE_X))) {
           //TODO:look at file to find perms
           res = -EACCES;
           break;
         }
-        *pte = pte_create(pte_ppn(*pte), prot_to_type(prot, 1));
+        if ((*pte & PTE_COW) && (prot & PROT_WRITE))
+          *pte = pte_create(pte_ppn(*pte), prot_to_type(prot & ~PROT_WRITE, 1) | PTE_COW);
+        else
+          *pte = pte_create(pte_ppn(*pte), prot_to_type(prot, 1));
+        tlb_batch_add(&batch, a);
       }
     }
+    tlb_batch_flush(&batch);
   spinlock_unlock(&vm_lock);
 
-  flush_tlb();
   return res;
 }
 
@@ -520,34 +845,93 @@ uintptr_t pk_vm_init()
   first_free_paddr = first_free_page + free_pages * RISCV_PGSIZE;
 
   root_page_table = (void*)__page_alloc();
+  zero_page = __page_alloc();
   __map_kernel_range(DRAM_BASE, DRAM_BASE, first_free_paddr - DRAM_BASE, PROT_READ|PROT_WRITE|PROT_EXEC);
 
   current.mmap_max = current.brk_max =
     MIN(DRAM_BASE, mem_size - (first_free_paddr - DRAM_BASE));
 
+  // User frames sit at a fixed offset above first_free_paddr, so stop user
+  // memory short of the initrd, and map the initrd for the kernel to read
+  if (initrd_end)
+  {
+    uintptr_t rd_start = ROUNDDOWN(initrd_start, RISCV_PGSIZE);
+    if (rd_start >= first_free_paddr)
+    {
+      __map_kernel_range(rd_start, rd_start, initrd_end - rd_start, PROT_READ);
+      current.mmap_max = current.brk_max =
+        MIN(current.mmap_max, rd_start - first_free_paddr);
+    }
+    else
+    {
+      printk("initrd at %p overlaps pk's memory; ignoring it\n", initrd_start);
+      initrd_start = initrd_end = 0;
+    }
+  }
+
   size_t stack_size = MIN(mem_pages >> 5, 2048) * RISCV_PGSIZE;
   size_t stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
   kassert(stack_bottom != (uintptr_t)-1);
   current.stack_top = stack_bottom + stack_size;
 
   flush_tlb();
-  write_csr(sptbr, ((uintptr_t)root_page_table >> RISCV_PGSHIFT) | SATP_MODE_CHOICE);
+  write_csr(sptbr, ((uintptr_t)root_page_table >> RISCV_PGSHIFT) |
+                   INSERT_FIELD(SATP_MODE_CHOICE, SATP_ASID, PK_ASID));
 
   uintptr_t kernel_stack_top = __page_alloc() + RISCV_PGSIZE;
   printk("%ld\n", mem_pages);
   return kernel_stack_top;
 }
 
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr)
+{
+  if (batch->count < TLB_BATCH_MAX)
+    batch->va[batch->count] = vaddr;
+  batch->count++;
+}
+
+void tlb_batch_flush(tlb_batch_t* batch)
+{
+  if (batch->count > TLB_BATCH_MAX) {
+    flush_tlb_asid(PK_ASID);
+  } else {
+    for (size_t i = 0; i < batch->count; i++)
+      flush_tlb_va(batch->va[i]);
+  }
+  batch->count = 0;
+}
+
+void flush_tlb_va(uintptr_t vaddr)
+{
+  flush_tlb_page_asid(vaddr, PK_ASID);
+}
+
+uintptr_t user_frame(uintptr_t vaddr)
+{
+  return __frame_ppn(vaddr >> RISCV_PGSHIFT) << RISCV_PGSHIFT;
+}
+
 uintptr_t page_alloc() {
   return __page_alloc();
 }
 
+uintptr_t page_try_alloc() {
+  return __page_try_alloc();
+}
+
 pte_t* walk(uintptr_t vaddr) {
   return __walk(vaddr);
 }
 
-inline uintptr_t va2pa(const void *va) {
+uintptr_t va2pa(const void *va) {
   uintptr_t ptr = (uintptr_t) va;
+
+  // The kernel image is identity-mapped and never evicted
+  if (ptr >= DRAM_BASE && ptr < first_free_page)
+    return ptr;
+
+  // Anything else is walked every time: the PFA rewrites user PTEs behind
+  // the kernel's back, so no translation of them can be cached
   pte_t *pte = walk(ptr);
   return ((*pte >> PTE_PPN_SHIFT) << RISCV_PGSHIFT) | (ptr & 0xFFF);
 }
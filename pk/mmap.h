@@ -17,8 +17,22 @@
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_POPULATE 0x8000
+#define MREMAP_MAYMOVE 0x1
 #define MREMAP_FIXED 0x2
 
+// Pending TLB invalidations. Fences are issued per page for small batches
+// and as one fence for the whole address space once the batch overflows.
+#define TLB_BATCH_MAX 16
+typedef struct {
+  size_t count;
+  uintptr_t va[TLB_BATCH_MAX];
+} tlb_batch_t;
+#define TLB_BATCH_INIT {0}
+
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr);
+void tlb_batch_flush(tlb_batch_t* batch);
+void flush_tlb_va(uintptr_t vaddr);
+
 extern int demand_paging;
 uintptr_t pk_vm_init();
 int handle_page_fault(uintptr_t vaddr, int prot);
@@ -32,6 +46,11 @@ uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags)
 uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot);
 uintptr_t do_brk(uintptr_t addr);
 uintptr_t page_alloc();
+// Like page_alloc, but returns 0 once the pool is used up
+uintptr_t page_try_alloc();
+// The frame a private page at vaddr gets. It sits at a fixed offset from the
+// VA unless mremap has moved frames between VAs.
+uintptr_t user_frame(uintptr_t vaddr);
 pte_t* walk(uintptr_t vaddr);
 uintptr_t va2pa(const void *va);
 
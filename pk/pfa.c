@@ -59,7 +59,7 @@ void pfa_evict_page_pgid(void const *page, pgid_t pgid)
 
   pte_t *page_pte = walk((uintptr_t) page);
   *page_pte = pfa_mk_remote_pte(pgid, *page_pte);
-  flush_tlb();
+  flush_tlb_va((uintptr_t)page);
 }
 
 bool pfa_poll_evict(void)
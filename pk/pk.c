@@ -8,6 +8,7 @@
 #include "atomic.h"
 #include "bits.h"
 #include "pfa.h"
+#include "clock.h"
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -768,6 +769,223 @@ bool test_emptyq(void)
   return true;
 }
 
+/* Read faults on anonymous memory should share the zero page read-only, and
+ * the first write should give the page a private, zeroed frame */
+bool test_zero_page(void)
+{
+  printk("test_zero_page\n");
+
+  size_t len = 2 * RISCV_PGSIZE;
+  uintptr_t addr = ROUNDDOWN(current.mmap_max / 2, RISCV_PGSIZE);
+  if (do_mmap(addr, len, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) != addr) {
+    printk("mmap failed\n");
+    return false;
+  }
+
+  volatile uint64_t *p0 = (volatile uint64_t*)addr;
+  volatile uint64_t *p1 = (volatile uint64_t*)(addr + RISCV_PGSIZE);
+
+  /* Read faults map the same read-only frame */
+  if (*p0 != 0 || *p1 != 0) {
+    printk("Fresh anonymous page not zero\n");
+    return false;
+  }
+  pte_t pte0 = *walk((uintptr_t)p0);
+  pte_t pte1 = *walk((uintptr_t)p1);
+  if ((pte0 & PTE_W) || (pte1 & PTE_W) ||
+      (pte0 >> PTE_PPN_SHIFT) != (pte1 >> PTE_PPN_SHIFT)) {
+    printk("Read faults did not share the zero page: pte0=%lx pte1=%lx\n", pte0, pte1);
+    return false;
+  }
+
+  /* Write fault breaks the sharing for p0 only */
+  *p0 = 42;
+  pte0 = *walk((uintptr_t)p0);
+  if (!(pte0 & PTE_W) || (pte0 >> PTE_PPN_SHIFT) == (pte1 >> PTE_PPN_SHIFT)) {
+    printk("Write fault did not allocate a private frame: pte0=%lx\n", pte0);
+    return false;
+  }
+
+  if (*p0 != 42 || *p1 != 0 || p0[1] != 0) {
+    printk("Page contents wrong after COW\n");
+    return false;
+  }
+
+  do_munmap(addr, len);
+
+  printk("test_zero_page success\n");
+  return true;
+}
+
+/* mremap moves PTEs rather than data: a remote page keeps its pgid across
+ * the move and is fetched at its new address */
+bool test_mremap_remote(void)
+{
+  printk("test_mremap_remote\n");
+
+  uintptr_t addr = ROUNDDOWN(current.mmap_max / 2, RISCV_PGSIZE);
+  int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED;
+  /* The page after the mapping is taken, so growing has to relocate */
+  if (do_mmap(addr, 2 * RISCV_PGSIZE, PROT_READ|PROT_WRITE, flags, -1, 0) != addr ||
+      do_mmap(addr + 2 * RISCV_PGSIZE, RISCV_PGSIZE, PROT_READ|PROT_WRITE, flags, -1, 0) != addr + 2 * RISCV_PGSIZE) {
+    printk("mmap failed\n");
+    return false;
+  }
+
+  volatile uint64_t *p0 = (volatile uint64_t*)addr;
+  volatile uint64_t *p1 = (volatile uint64_t*)(addr + RISCV_PGSIZE);
+  *p0 = 17;
+  *p1 = 42;
+  uintptr_t f0 = va2pa((void*)p0);
+  uintptr_t f1 = va2pa((void*)p1);
+
+  pgid_t pgid = pfa_evict_page((void*)p1);
+  if(!pfa_poll_evict())
+    return false;
+
+  /* No program is loaded, so give __vm_alloc a place to search from */
+  size_t brk = current.brk;
+  current.brk = ROUNDDOWN(current.mmap_max / 4, RISCV_PGSIZE);
+  uintptr_t moved = do_mremap(addr, 2 * RISCV_PGSIZE, 3 * RISCV_PGSIZE, MREMAP_MAYMOVE);
+  current.brk = brk;
+
+  if (IS_ERR_VALUE(moved) || moved == addr) {
+    printk("mremap did not relocate: %lx\n", moved);
+    return false;
+  }
+
+  pte_t *old_pte = walk(addr);
+  if (old_pte && *old_pte) {
+    printk("Old PTE still present: %lx\n", *old_pte);
+    return false;
+  }
+
+  if (!pte_is_remote(*walk(moved + RISCV_PGSIZE))) {
+    printk("Remote PTE was not moved intact\n");
+    return false;
+  }
+
+  /* The resident page keeps its frame, which now belongs to the new VA */
+  if (va2pa((void*)moved) != f0 || user_frame(moved) != f0 ||
+      *(volatile uint64_t*)moved != 17) {
+    printk("Resident page did not keep its frame\n");
+    return false;
+  }
+
+  /* Fetch the remote page at its new address, into that address's frame */
+  pfa_publish_freeframe(user_frame(moved + RISCV_PGSIZE));
+  if (*(volatile uint64_t*)(moved + RISCV_PGSIZE) != 42) {
+    printk("Remote page has wrong contents after move\n");
+    return false;
+  }
+
+  uintptr_t new_vaddr = *PFA_NEWVADDR;
+  pgid_t new_pgid = (pgid_t)(*PFA_NEWPGID);
+  if (new_vaddr != moved + RISCV_PGSIZE || new_pgid != pgid) {
+    printk("Fetched (%lx, %ld), expected (%lx, %ld)\n",
+           new_vaddr, new_pgid, moved + RISCV_PGSIZE, pgid);
+    return false;
+  }
+
+  if (*(volatile uint64_t*)(moved + 2 * RISCV_PGSIZE) != 0) {
+    printk("Grown tail not zero\n");
+    return false;
+  }
+
+  /* Reusing the vacated range must not hand out the moved pages' frames */
+  if (do_mmap(addr, 2 * RISCV_PGSIZE, PROT_READ|PROT_WRITE, flags, -1, 0) != addr) {
+    printk("mmap of the old range failed\n");
+    return false;
+  }
+  *p0 = 1;
+  *p1 = 2;
+  if (va2pa((void*)p0) == f0 || va2pa((void*)p1) != f1 ||
+      va2pa((void*)p1) == va2pa((void*)(moved + RISCV_PGSIZE))) {
+    printk("Old range got unexpected frames\n");
+    return false;
+  }
+  if (*(volatile uint64_t*)moved != 17 ||
+      *(volatile uint64_t*)(moved + RISCV_PGSIZE) != 42) {
+    printk("Moved data clobbered by the old range\n");
+    return false;
+  }
+
+  check_pfa_clean();
+
+  do_munmap(moved, 3 * RISCV_PGSIZE);
+  do_munmap(addr, 3 * RISCV_PGSIZE);
+
+  printk("test_mremap_remote success\n");
+  return true;
+}
+
+/* Growing a file mapping continues the file even when every page of the
+ * old range is already resident */
+bool test_mremap_file(void)
+{
+  printk("test_mremap_file\n");
+
+  static uint64_t buf[RISCV_PGSIZE / sizeof(uint64_t)];
+  const char* name = "mremap_file.tmp";
+  file_t* f = file_open(name, PK_O_WRONLY|PK_O_CREAT|PK_O_TRUNC, 0600);
+  if (IS_ERR_VALUE(f)) {
+    printk("Could not create %s\n", name);
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    buf[0] = i + 1;
+    file_write(f, buf, sizeof(buf));
+  }
+  file_decref(f);
+
+  f = file_open(name, 0, 0);
+  if (IS_ERR_VALUE(f))
+    return false;
+  int fd = file_dup(f);
+  file_decref(f);
+
+  uintptr_t addr = ROUNDDOWN(current.mmap_max / 2, RISCV_PGSIZE);
+  int flags = MAP_PRIVATE|MAP_FIXED;
+  if (do_mmap(addr, 2 * RISCV_PGSIZE, PROT_READ, flags, fd, 0) != addr ||
+      do_mmap(addr + 2 * RISCV_PGSIZE, RISCV_PGSIZE, PROT_READ, flags|MAP_ANONYMOUS, -1, 0) != addr + 2 * RISCV_PGSIZE) {
+    printk("mmap failed\n");
+    return false;
+  }
+
+  if (*(volatile uint64_t*)addr != 1 ||
+      *(volatile uint64_t*)(addr + RISCV_PGSIZE) != 2) {
+    printk("Mapped file has wrong contents\n");
+    return false;
+  }
+
+  size_t brk = current.brk;
+  current.brk = ROUNDDOWN(current.mmap_max / 4, RISCV_PGSIZE);
+  uintptr_t moved = do_mremap(addr, 2 * RISCV_PGSIZE, 3 * RISCV_PGSIZE, MREMAP_MAYMOVE);
+  current.brk = brk;
+
+  if (IS_ERR_VALUE(moved) || moved == addr) {
+    printk("mremap did not relocate: %lx\n", moved);
+    return false;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    uint64_t val = *(volatile uint64_t*)(moved + i * RISCV_PGSIZE);
+    if (val != i + 1) {
+      printk("Page %d of the grown mapping reads %ld\n", i, val);
+      return false;
+    }
+  }
+
+  do_munmap(moved, 3 * RISCV_PGSIZE);
+  do_munmap(addr, 3 * RISCV_PGSIZE);
+  fd_close(fd);
+  frontend_syscall(SYS_unlinkat, AT_FDCWD, va2pa(name), strlen(name) + 1, 0, 0, 0, 0);
+
+  printk("test_mremap_file success\n");
+  return true;
+}
+
 int main()
 {
   pfa_init();
@@ -832,6 +1050,21 @@ int main()
     return EXIT_FAILURE;
   }
 
+  if(!test_zero_page()) {
+    printk("Test Failure!\n");
+    return EXIT_FAILURE;
+  }
+
+  if(!test_mremap_remote()) {
+    printk("Test Failure!\n");
+    return EXIT_FAILURE;
+  }
+
+  if(!test_mremap_file()) {
+    printk("Test Failure!\n");
+    return EXIT_FAILURE;
+  }
+
 
   if(!test_n(32)) { // takes about 2m cycles
     printk("Test Failure!\n");
@@ -852,6 +1085,7 @@ static void rest_of_boot_loader(uintptr_t kstack_top)
   current.time0 = rdtime();
   current.cycle0 = rdcycle();
   current.instret0 = rdinstret();
+  clock_init();
 
   printk("rest_of_boot_loader\n");
 
@@ -877,7 +1111,9 @@ void boot_loader(uintptr_t dtb)
   set_csr(sstatus, SSTATUS_SUM);
 
   file_init();
-  enter_supervisor_mode(rest_of_boot_loader, pk_vm_init(), 0);
+  uintptr_t kernel_stack_top = pk_vm_init();
+  ramfs_init(initrd_start, initrd_end);
+  enter_supervisor_mode(rest_of_boot_loader, kernel_stack_top, 0);
 }
 
 void boot_other_hart(uintptr_t dtb)
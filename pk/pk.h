@@ -29,6 +29,7 @@ typedef struct
 #define kassert(cond) do { if(!(cond)) kassert_fail(""#cond); } while(0)
 void do_panic(const char* s, ...) __attribute__((noreturn));
 void kassert_fail(const char* s) __attribute__((noreturn));
+extern volatile int panicking;
 
 #ifdef __cplusplus
 extern "C" {
@@ -0,0 +1,225 @@
+// See LICENSE for license details.
+
+#include "ramfs.h"
+#include "mmap.h"
+#include "pk.h"
+#include "bits.h"
+#include <string.h>
+#include <errno.h>
+
+#define CPIO_MAGIC "07070"  // "070701", or "070702" with checksums
+#define CPIO_HDR_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+// Field indices in a newc header, each eight hex digits after the magic
+enum { CPIO_INO, CPIO_MODE, CPIO_UID, CPIO_GID, CPIO_NLINK, CPIO_MTIME,
+       CPIO_FILESIZE, CPIO_DEVMAJOR, CPIO_DEVMINOR, CPIO_RDEVMAJOR,
+       CPIO_RDEVMINOR, CPIO_NAMESIZE, CPIO_CHECK };
+
+static const char* image;
+static size_t image_size;
+
+// The archive is walked once, by ramfs_init, into an index of its entries
+// hashed on name. The index lives in pages from the kernel pool.
+typedef struct
+{
+  const char* name;
+  ramfs_node_t node;
+  int32_t next; // next entry in the hash chain; -1 ends it
+} ramfs_entry_t;
+
+#define RAMFS_CHUNK (RISCV_PGSIZE / sizeof(ramfs_entry_t))
+#define RAMFS_MAX_CHUNKS 64
+#define RAMFS_BUCKETS (RISCV_PGSIZE / sizeof(int32_t))
+
+static ramfs_entry_t* entry_chunks[RAMFS_MAX_CHUNKS];
+static int32_t* buckets;
+static size_t nentries;
+
+static uint32_t cpio_field(const char* hdr, int i)
+{
+  const char* p = hdr + 6 + 8*i;
+  uint32_t v = 0;
+  for (int j = 0; j < 8; j++)
+  {
+    char c = p[j];
+    v = v*16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+  }
+  return v;
+}
+
+// Names are stored as "a/b", "./a/b" or "/a/b"
+static const char* skip_root(const char* name)
+{
+  while (1)
+  {
+    if (name[0] == '/')
+      name++;
+    else if (name[0] == '.' && name[1] == '/')
+      name += 2;
+    else if (name[0] == '.' && name[1] == 0)
+      name++;
+    else
+      return name;
+  }
+}
+
+// Calls fn on each entry until it returns nonzero; returns that value
+static int cpio_walk(int (*fn)(const char*, const ramfs_node_t*, void*), void* arg)
+{
+  size_t off = 0;
+  while (off + CPIO_HDR_SIZE <= image_size)
+  {
+    const char* hdr = image + off;
+    if (memcmp(hdr, CPIO_MAGIC, 5) != 0)
+      break;
+
+    size_t namesize = cpio_field(hdr, CPIO_NAMESIZE);
+    size_t data = ROUNDUP(off + CPIO_HDR_SIZE + namesize, 4);
+    const char* name = hdr + CPIO_HDR_SIZE;
+    if (namesize == 0 || data > image_size || name[namesize-1] != 0 ||
+        !strcmp(name, CPIO_TRAILER))
+      break;
+
+    ramfs_node_t node = {
+      .data = image + data,
+      .size = cpio_field(hdr, CPIO_FILESIZE),
+      .mode = cpio_field(hdr, CPIO_MODE),
+      .ino = cpio_field(hdr, CPIO_INO),
+      .mtime = cpio_field(hdr, CPIO_MTIME),
+    };
+    if (node.size > image_size - data)
+      break;
+
+    int ret = fn(skip_root(name), &node, arg);
+    if (ret)
+      return ret;
+    off = ROUNDUP(data + node.size, 4);
+  }
+  return 0;
+}
+
+static uint32_t name_hash(const char* name)
+{
+  uint32_t h = 2166136261U; // FNV-1a
+  while (*name)
+    h = (h ^ (uint8_t)*name++) * 16777619U;
+  return h % RAMFS_BUCKETS;
+}
+
+static ramfs_entry_t* entry_at(int32_t i)
+{
+  return &entry_chunks[i / RAMFS_CHUNK][i % RAMFS_CHUNK];
+}
+
+static ramfs_entry_t* index_find(const char* name)
+{
+  for (int32_t i = buckets[name_hash(name)]; i >= 0; i = entry_at(i)->next)
+    if (!strcmp(entry_at(i)->name, name))
+      return entry_at(i);
+  return NULL;
+}
+
+static int index_entry(const char* name, const ramfs_node_t* node, void* arg)
+{
+  // An archive may name a path twice; the first entry wins
+  if (index_find(name))
+    return 0;
+
+  size_t c = nentries / RAMFS_CHUNK;
+  if (c == RAMFS_MAX_CHUNKS)
+    return -ENOMEM;
+  if (!entry_chunks[c] && !(entry_chunks[c] = (void*)page_try_alloc()))
+    return -ENOMEM;
+
+  ramfs_entry_t* e = entry_at(nentries);
+  uint32_t h = name_hash(name);
+  e->name = name;
+  e->node = *node;
+  e->next = buckets[h];
+  buckets[h] = nentries++;
+  return 0;
+}
+
+void ramfs_init(uintptr_t start, uintptr_t end)
+{
+  if (start == end)
+    return;
+
+  image = (const char*)start;
+  image_size = end - start;
+
+  if ((buckets = (int32_t*)page_try_alloc()))
+    memset(buckets, -1, RISCV_PGSIZE);
+  if (!buckets || cpio_walk(index_entry, NULL))
+  {
+    printk("initrd at %p is too big to index; ignoring it\n", start);
+    image_size = 0;
+    return;
+  }
+  if (nentries == 0)
+  {
+    printk("initrd at %p is not a newc cpio archive; ignoring it\n", start);
+    image_size = 0;
+    return;
+  }
+  printk("initrd: %ld entries mounted on %s\n", nentries, RAMFS_MOUNT);
+}
+
+// Returns the path relative to the mount, or NULL if it lies outside it
+static const char* ramfs_relpath(const char* path)
+{
+  size_t len = strlen(RAMFS_MOUNT);
+  if (image_size == 0 || strncmp(path, RAMFS_MOUNT, len) != 0 ||
+      (path[len] != '/' && path[len] != 0))
+    return NULL;
+  return skip_root(path + len);
+}
+
+int ramfs_owns(const char* path)
+{
+  return ramfs_relpath(path) != NULL;
+}
+
+int ramfs_lookup(const char* path, ramfs_node_t* node)
+{
+  const char* rel = ramfs_relpath(path);
+  if (rel == NULL)
+    return -ENOENT;
+
+  if (*rel == 0)
+  {
+    // The mount point itself, which the archive need not list
+    *node = (ramfs_node_t){ .data = image, .mode = S_IFDIR | 0555 };
+    return 0;
+  }
+
+  ramfs_entry_t* e = index_find(rel);
+  if (e == NULL)
+    return -ENOENT;
+  *node = e->node;
+  return 0;
+}
+
+void ramfs_stat(const ramfs_node_t* node, struct stat* s)
+{
+  memset(s, 0, sizeof(*s));
+  s->st_ino = node->ino;
+  s->st_mode = node->mode;
+  s->st_nlink = 1;
+  s->st_size = node->size;
+  s->st_blksize = RISCV_PGSIZE;
+  s->st_blocks = (node->size + 511) / 512;
+  s->st_atime = s->st_mtime = s->st_ctime = node->mtime;
+}
+
+// The image page holding offset, if a user mapping can share it: it must be
+// page-aligned in the image and lie entirely within the file, so the user
+// sees neither a neighbouring file nor anything but zeroes past EOF
+uintptr_t ramfs_page(const ramfs_node_t* node, size_t offset)
+{
+  uintptr_t page = (uintptr_t)node->data + offset;
+  if ((page & (RISCV_PGSIZE-1)) || offset + RISCV_PGSIZE > node->size)
+    return 0;
+  return page;
+}
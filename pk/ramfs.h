@@ -0,0 +1,32 @@
+// See LICENSE for license details.
+
+#ifndef _PK_RAMFS_H
+#define _PK_RAMFS_H
+
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Paths under this prefix are looked up in the initrd, a cpio archive in
+// the "newc" format (as made by cpio -H newc) that the boot loader placed in
+// memory and named in /chosen. File pages that are page-aligned in the image
+// are mapped in place; the rest are copied out, as newc aligns data to only
+// 4 bytes.
+#define RAMFS_MOUNT "/initrd"
+
+typedef struct ramfs_node
+{
+  const char* data; // contents, in the image; NULL for no node
+  size_t size;
+  uint32_t mode;
+  uint32_t ino;
+  uint32_t mtime;
+} ramfs_node_t;
+
+void ramfs_init(uintptr_t start, uintptr_t end);
+int ramfs_owns(const char* path);
+int ramfs_lookup(const char* path, ramfs_node_t* node);
+void ramfs_stat(const ramfs_node_t* node, struct stat* s);
+uintptr_t ramfs_page(const ramfs_node_t* node, size_t offset);
+
+#endif
@@ -6,12 +6,86 @@
 #include "frontend.h"
 #include "mmap.h"
 #include "boot.h"
+#include "clock.h"
 #include <string.h>
 #include <errno.h>
 
 typedef long (*syscall_t)(long, long, long, long, long, long, long);
 
-#define CLOCK_FREQ 1000000000
+// Per-syscall profile, hashed on the syscall number
+#define SYSCALL_PROF_SLOTS 64
+typedef struct {
+  long n;
+  uint64_t count;
+  uint64_t cycles;      // total, from entry to do_syscall to return
+  uint64_t host_cycles; // part of cycles spent on the host
+} syscall_prof_t;
+
+static syscall_prof_t syscall_prof[SYSCALL_PROF_SLOTS];
+
+static syscall_prof_t* syscall_prof_slot(long n)
+{
+  for (size_t i = 0; i < SYSCALL_PROF_SLOTS; i++)
+  {
+    syscall_prof_t* p = &syscall_prof[(n + i) % SYSCALL_PROF_SLOTS];
+    if (p->count == 0)
+      p->n = n;
+    if (p->n == n)
+      return p;
+  }
+  return NULL;
+}
+
+static void syscall_prof_print()
+{
+  printk("%8s %10s %14s %14s\n", "syscall", "count", "cycles", "host cycles");
+  for (syscall_prof_t* p = syscall_prof; p < syscall_prof + SYSCALL_PROF_SLOTS; p++)
+    if (p->count)
+      printk("%8ld %10ld %14ld %14ld\n", p->n, p->count, p->cycles, p->host_cycles);
+}
+
+#ifdef PK_ENABLE_SYSCALL_PROFILE_FILE
+static void syscall_prof_write()
+{
+  file_t* f = file_open("syscall_profile.csv", PK_O_WRONLY|PK_O_CREAT|PK_O_TRUNC, 0644);
+  if (IS_ERR_VALUE(f))
+    return;
+
+  char line[96];
+  int len = snprintf(line, sizeof(line), "syscall,count,cycles,host_cycles\n");
+  file_write(f, line, len);
+  for (syscall_prof_t* p = syscall_prof; p < syscall_prof + SYSCALL_PROF_SLOTS; p++)
+  {
+    if (p->count)
+    {
+      len = snprintf(line, sizeof(line), "%ld,%ld,%ld,%ld\n",
+                     p->n, p->count, p->cycles, p->host_cycles);
+      file_write(f, line, len);
+    }
+  }
+  file_decref(f);
+}
+#endif
+
+// Report the profile on the way down, if any syscalls were made. Only
+// once, should a panic bring us back here.
+void syscall_prof_dump()
+{
+  static int dumped;
+  if (dumped++)
+    return;
+
+  size_t used = 0;
+  for (syscall_prof_t* p = syscall_prof; p < syscall_prof + SYSCALL_PROF_SLOTS; p++)
+    used += p->count;
+  if (!used)
+    return;
+
+  syscall_prof_print();
+#ifdef PK_ENABLE_SYSCALL_PROFILE_FILE
+  syscall_prof_write();
+#endif
+}
 
 void sys_exit(int code)
 {
@@ -89,10 +163,8 @@ int sys_openat(int dirfd, const char* name, int flags, int mode)
       return PTR_ERR(file);
 
     int fd = file_dup(file);
-    if (fd < 0) {
+    if (fd < 0)
       file_decref(file);
-      return -ENOMEM;
-    }
 
     return fd;
   }
@@ -180,6 +252,20 @@ int sys_dup(int fd)
   return r;
 }
 
+int sys_fsync(int fd)
+{
+  int r = -EBADF;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = file_sync(f);
+    file_decref(f);
+  }
+
+  return r;
+}
+
 ssize_t sys_lseek(int fd, size_t ptr, int dir)
 {
   ssize_t r = -EBADF;
@@ -194,8 +280,21 @@ ssize_t sys_lseek(int fd, size_t ptr, int dir)
   return r;
 }
 
+// Paths in the initrd are resolved here rather than by the host
+static long ramfs_fstatat(const char* name, void* st)
+{
+  ramfs_node_t node;
+  long ret = ramfs_lookup(name, &node);
+  if (ret == 0)
+    ramfs_stat(&node, st);
+  return ret;
+}
+
 long sys_lstat(const char* name, void* st)
 {
+  if (ramfs_owns(name))
+    return ramfs_fstatat(name, st);
+
   struct frontend_stat buf;
   size_t name_size = strlen(name)+1;
   long ret = frontend_syscall(SYS_lstat, va2pa(name), name_size, va2pa(&buf), 0, 0, 0, 0);
@@ -205,6 +304,9 @@ long sys_lstat(const char* name, void* st)
 
 long sys_fstatat(int dirfd, const char* name, void* st, int flags)
 {
+  if (ramfs_owns(name))
+    return ramfs_fstatat(name, st);
+
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     struct frontend_stat buf;
@@ -223,6 +325,15 @@ long sys_stat(const char* name, void* st)
 
 long sys_faccessat(int dirfd, const char *name, int mode)
 {
+  if (ramfs_owns(name))
+  {
+    ramfs_node_t node;
+    long ret = ramfs_lookup(name, &node);
+    if (ret == 0 && (mode & W_OK))
+      ret = -EROFS;
+    return ret;
+  }
+
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
@@ -353,7 +464,9 @@ int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
 
 long sys_time(long* loc)
 {
-  uintptr_t t = rdcycle() / CLOCK_FREQ;
+  uint64_t ns;
+  clock_get_ns(PK_CLOCK_REALTIME, &ns);
+  uintptr_t t = ns / 1000000000;
   if (loc)
     *loc = t;
   return t;
@@ -361,9 +474,10 @@ long sys_time(long* loc)
 
 int sys_times(long* loc)
 {
-  uintptr_t t = rdcycle();
-  kassert(CLOCK_FREQ % 1000000 == 0);
-  loc[0] = t / (CLOCK_FREQ / 1000000);
+  // The process owns the hart from start to exit, so its user time is
+  // taken to be the time since it started
+  uint64_t ns = clock_ns(rdtime() - current.time0);
+  loc[0] = ns / 1000;
   loc[1] = 0;
   loc[2] = 0;
   loc[3] = 0;
@@ -373,24 +487,88 @@ int sys_times(long* loc)
 
 int sys_gettimeofday(long* loc)
 {
-  uintptr_t t = rdcycle();
-  loc[0] = t / CLOCK_FREQ;
-  loc[1] = (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000);
+  uint64_t ns;
+  clock_get_ns(PK_CLOCK_REALTIME, &ns);
+  loc[0] = ns / 1000000000;
+  loc[1] = ns % 1000000000 / 1000;
   
   return 0;
 }
 
+int sys_clock_gettime(int clk, long* ts)
+{
+  uint64_t ns;
+  if (clock_get_ns(clk, &ns) < 0)
+    return -EINVAL;
+  ts[0] = ns / 1000000000;
+  ts[1] = ns % 1000000000;
+  return 0;
+}
+
+#define IOV_MAX 1024
+
+ssize_t sys_readv(int fd, const long* iov, int cnt)
+{
+  ssize_t r = -EBADF;
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -EINVAL;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = file_readv(f, iov, cnt);
+    file_decref(f);
+  }
+
+  return r;
+}
+
+ssize_t sys_preadv(int fd, const long* iov, int cnt, off_t offset)
+{
+  ssize_t r = -EBADF;
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -EINVAL;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = file_preadv(f, iov, cnt, offset);
+    file_decref(f);
+  }
+
+  return r;
+}
+
 ssize_t sys_writev(int fd, const long* iov, int cnt)
 {
-  ssize_t ret = 0;
-  for (int i = 0; i < cnt; i++)
+  ssize_t r = -EBADF;
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -EINVAL;
+  file_t* f = file_get(fd);
+
+  if (f)
   {
-    ssize_t r = sys_write(fd, (void*)iov[2*i], iov[2*i+1]);
-    if (r < 0)
-      return r;
-    ret += r;
+    r = file_writev(f, iov, cnt);
+    file_decref(f);
   }
-  return ret;
+
+  return r;
+}
+
+ssize_t sys_pwritev(int fd, const long* iov, int cnt, off_t offset)
+{
+  ssize_t r = -EBADF;
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -EINVAL;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = file_pwritev(f, iov, cnt, offset);
+    file_decref(f);
+  }
+
+  return r;
 }
 
 int sys_chdir(const char *path)
@@ -425,6 +603,7 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_close] = sys_close,
     [SYS_fstat] = sys_fstat,
     [SYS_lseek] = sys_lseek,
+    [SYS_fsync] = sys_fsync,
     [SYS_fstatat] = sys_fstatat,
     [SYS_linkat] = sys_linkat,
     [SYS_unlinkat] = sys_unlinkat,
@@ -446,7 +625,10 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_rt_sigaction] = sys_rt_sigaction,
     [SYS_gettimeofday] = sys_gettimeofday,
     [SYS_times] = sys_times,
+    [SYS_readv] = sys_readv,
     [SYS_writev] = sys_writev,
+    [SYS_preadv] = sys_preadv,
+    [SYS_pwritev] = sys_pwritev,
     [SYS_faccessat] = sys_faccessat,
     [SYS_fcntl] = sys_fcntl,
     [SYS_ftruncate] = sys_ftruncate,
@@ -455,7 +637,7 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_readlinkat] = sys_stub_nosys,
     [SYS_rt_sigprocmask] = sys_stub_success,
     [SYS_ioctl] = sys_stub_nosys,
-    [SYS_clock_gettime] = sys_stub_nosys,
+    [SYS_clock_gettime] = sys_clock_gettime,
     [SYS_getrusage] = sys_stub_nosys,
     [SYS_getrlimit] = sys_stub_nosys,
     [SYS_setrlimit] = sys_stub_nosys,
@@ -485,5 +667,15 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
   if (!f)
     panic("bad syscall #%ld!",n);
 
-  return f(a0, a1, a2, a3, a4, a5, n);
+  uint64_t c0 = rdcycle(), h0 = frontend_host_cycles;
+  long ret = f(a0, a1, a2, a3, a4, a5, n);
+
+  syscall_prof_t* p = syscall_prof_slot(n);
+  if (p)
+  {
+    p->count++;
+    p->cycles += rdcycle() - c0;
+    p->host_cycles += frontend_host_cycles - h0;
+  }
+  return ret;
 }
@@ -20,6 +20,7 @@
 #define SYS_chdir 49
 #define SYS_getcwd 17
 #define SYS_fstat 80
+#define SYS_fsync 82
 #define SYS_fstatat 79
 #define SYS_faccessat 48
 #define SYS_pread 67
@@ -36,7 +37,10 @@
 #define SYS_prlimit64 261
 #define SYS_getmainvars 2011
 #define SYS_rt_sigaction 134
+#define SYS_readv 65
 #define SYS_writev 66
+#define SYS_preadv 69
+#define SYS_pwritev 70
 #define SYS_gettimeofday 169
 #define SYS_times 153
 #define SYS_fcntl 25
@@ -69,6 +73,14 @@
 
 #define AT_FDCWD -100
 
+// open(2) flags. User programs and the host agree on them, so pk passes
+// them through unchanged.
+#define PK_O_ACCMODE 03
+#define PK_O_WRONLY 01
+#define PK_O_CREAT 0100
+#define PK_O_TRUNC 01000
+
 long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned long n);
+void syscall_prof_dump();
 
 #endif